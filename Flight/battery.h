@@ -0,0 +1,173 @@
+#ifndef BATTERY_H
+#define BATTERY_H
+
+#include <cstdint>
+#include <cmath>
+
+#include <atomic>
+#include <random>
+
+#include <bcm2835.h>
+
+#include "spi_lock.h"
+
+// Battery voltage for the VOLTS telemetry field.
+//
+// The battery reaches an MCP3008 on SPI0 CE1 through a resistor divider. payload reads it on a
+// background thread at BATTERY_RATE: each reading averages BATTERY_OVERSAMPLE conversions, then an
+// exponential filter with time constant BATTERY_TAU_S smooths out load steps like the radio
+// keying up. The result is cached in an atomic, so packing a frame costs one load and the flight
+// loop never waits on the bus.
+//
+// Each conversion is one 3 byte bcm2835_spi_transfernb() under spi_lock, since radio's RF95 shares
+// the bus; the controller's mode, chip select and clock are saved before and restored after, and
+// only the pins this needs are switched to SPI, so CE0 stays the GPIO radio uses for chip select.
+// The lock is taken per conversion, never across the oversampled reading, so radio waits at most
+// one transfer: 24 bits at ~1 MHz plus the register save and restore, around 30 us.
+//
+// In simulation there's no ADC: the same filter runs on a pack discharging at BATTERY_SIM_DRAIN
+// with noise, on the st_read() timebase.
+
+#define BATTERY_RATE 10 // Readings per second.
+#define BATTERY_OVERSAMPLE 8
+#define BATTERY_TAU_S 2.0
+#define BATTERY_CHANNEL 0 // MCP3008 single-ended input.
+#define BATTERY_VREF 3.3 // V, MCP3008 reference.
+#define BATTERY_DIVIDER 5.7 // Battery volts per ADC volt: 47k over 10k.
+#define BATTERY_SPI_DIVIDER BCM2835_SPI_CLOCK_DIVIDER_256 // ~1 MHz, within the MCP3008's limit at 3.3 V.
+#define BATTERY_LOW 10.5 // V, 3.5 V/cell on the 3S pack.
+#define BATTERY_LOW_HYSTERESIS 0.3 // V
+#define BATTERY_SIM_VOLTS 12.4
+#define BATTERY_SIM_DRAIN 0.5 // V per hour.
+
+enum battery_status {
+	BATTERY_OK = 0,
+	BATTERY_RAIL, // Every conversion read 0 or full scale: no ADC, or the divider is open.
+	BATTERY_WENT_LOW, // Crossed below BATTERY_LOW.
+};
+
+class battery_monitor {
+public:
+	battery_monitor() : simulated(false), sim_start(0), lock(NULL), cs_reg(NULL), clk_reg(NULL), filtered(0), have_reading(false), last(0), is_low(false),
+		lowest(INFINITY), readings(0), rail_errors(0), rng(14), noise(0, 1), value(-1) {}
+
+	// Flight hardware; after bcm2835_init().
+	void open_spi(spi_lock& bus) {
+		lock = &bus;
+		cs_reg = bcm2835_spi0 + BCM2835_SPI0_CS / 4;
+		clk_reg = bcm2835_spi0 + BCM2835_SPI0_CLK / 4;
+
+		bcm2835_gpio_fsel(RPI_V2_GPIO_P1_21, BCM2835_GPIO_FSEL_ALT0); // MISO
+		bcm2835_gpio_fsel(RPI_V2_GPIO_P1_19, BCM2835_GPIO_FSEL_ALT0); // MOSI
+		bcm2835_gpio_fsel(RPI_V2_GPIO_P1_23, BCM2835_GPIO_FSEL_ALT0); // SCLK
+		bcm2835_gpio_fsel(RPI_V2_GPIO_P1_26, BCM2835_GPIO_FSEL_ALT0); // CE1
+	}
+
+	// Simulation, with the pack fully charged at now.
+	void open_sim(uint64_t now) {
+		simulated = true;
+		sim_start = now;
+	}
+
+	// Takes one reading. Safe to call from one thread only.
+	battery_status sample(uint64_t now) {
+		uint32_t sum = 0;
+		int rails = 0;
+
+		for(int i = 0; i < BATTERY_OVERSAMPLE; i++) {
+			uint16_t code = simulated ? simulate(now) : convert();
+
+			sum += code;
+			rails += code == 0 || code == 1023;
+		}
+
+		if(rails == BATTERY_OVERSAMPLE) {
+			rail_errors++;
+			return BATTERY_RAIL;
+		}
+
+		float volts = sum / (1024.0f * BATTERY_OVERSAMPLE) * BATTERY_VREF * BATTERY_DIVIDER;
+		float dt = have_reading && now > last ? (now - last) / 1e6f : 0;
+
+		filtered = have_reading ? filtered + (volts - filtered) * (dt / (BATTERY_TAU_S + dt)) : volts;
+		have_reading = true;
+		last = now;
+		readings++;
+
+		if(filtered < lowest)
+			lowest = filtered;
+
+		// 0.1 V units, 8 bits; 255 is left for no reading (-1).
+		int dv = (int)lroundf(filtered * 10);
+		value.store(dv < 0 ? 0 : dv > 254 ? 254 : dv, std::memory_order_relaxed);
+
+		if(!is_low && filtered < BATTERY_LOW) {
+			is_low = true;
+			return BATTERY_WENT_LOW;
+		}
+
+		if(is_low && filtered > BATTERY_LOW + BATTERY_LOW_HYSTERESIS)
+			is_low = false;
+
+		return BATTERY_OK;
+	}
+
+	// Filtered voltage in 0.1 V, for TLM_VOLTS. -1 until the first good reading. Any thread.
+	int decivolts() const { return value.load(std::memory_order_relaxed); }
+
+	float voltage() const { return filtered; }
+	float minimum() const { return lowest; }
+	uint64_t count() const { return readings; }
+	uint64_t rail_count() const { return rail_errors; }
+
+private:
+	// One single-ended MCP3008 conversion: start bit, SGL/DIFF and channel, then 10 bits back.
+	uint16_t convert() {
+		char tx[3] = {0x01, (char)(0x80 | BATTERY_CHANNEL << 4), 0x00};
+		char rx[3];
+		spi_guard guard(*lock);
+
+		uint32_t cs = bcm2835_peri_read(cs_reg);
+		uint32_t clk = bcm2835_peri_read(clk_reg);
+
+		bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
+		bcm2835_spi_setClockDivider(BATTERY_SPI_DIVIDER);
+		bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS1, LOW);
+		bcm2835_spi_chipSelect(BCM2835_SPI_CS1);
+		bcm2835_spi_transfernb(tx, rx, sizeof(tx));
+
+		bcm2835_peri_write(clk_reg, clk);
+		bcm2835_peri_write(cs_reg, cs & (BCM2835_SPI0_CS_CS | BCM2835_SPI0_CS_CPOL | BCM2835_SPI0_CS_CPHA | BCM2835_SPI0_CS_CSPOL |
+		                                 BCM2835_SPI0_CS_CSPOL0 | BCM2835_SPI0_CS_CSPOL1 | BCM2835_SPI0_CS_CSPOL2));
+
+		return (rx[1] & 0x03) << 8 | (uint8_t)rx[2];
+	}
+
+	uint16_t simulate(uint64_t now) {
+		double volts = BATTERY_SIM_VOLTS - BATTERY_SIM_DRAIN * (now - sim_start) / 3600e6 + 0.05 * noise(rng);
+		long code = lround(volts / BATTERY_DIVIDER / BATTERY_VREF * 1024);
+
+		return code < 0 ? 0 : code > 1023 ? 1023 : code;
+	}
+
+	bool simulated;
+	uint64_t sim_start;
+	spi_lock* lock;
+	volatile uint32_t* cs_reg;
+	volatile uint32_t* clk_reg;
+
+	float filtered; // V
+	bool have_reading;
+	uint64_t last;
+	bool is_low;
+	float lowest;
+	uint64_t readings;
+	uint64_t rail_errors;
+
+	std::mt19937 rng;
+	std::normal_distribution<double> noise;
+
+	std::atomic<int> value;
+};
+
+#endif //BATTERY_H
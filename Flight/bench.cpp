@@ -0,0 +1,294 @@
+/*
+ * bench.cpp -- TECS code: microbenchmarks for the hot paths that don't need flight hardware.
+ *
+ * Build with `make bench`, run with `./bench [iterations]`.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#include <chrono>
+#include <vector>
+
+#include "common.h"
+#include "fec.h"
+#include "scan.h"
+#include "telemetry.h"
+
+static const int field_bits[TLM_FIELD_COUNT] = {6, 6, 6, 6, 9, 10, 10, 12, 9, 9, 9, 12, 8, 8, 8};
+
+// Keeps the optimizer from discarding benchmark results.
+volatile uint64_t sink;
+
+size_t iterations = 1000000;
+
+typedef std::chrono::steady_clock bench_clock;
+
+double elapsed_ns(bench_clock::time_point start) {
+	return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+void report(const char* name, double ns, size_t items, size_t bytes) {
+	printf("  %-32s %8.2f ns/frame  %8.2f Mframes/s  %8.2f MB/s\n", name, ns / items, items * 1e3 / ns, bytes * 1e3 / ns);
+}
+
+void fill_samples(std::vector<int64_t>& rows, std::vector<std::vector<int32_t> >& columns, size_t frames) {
+	rows.resize(frames * TLM_FIELD_COUNT);
+	columns.assign(TLM_FIELD_COUNT, std::vector<int32_t>(frames));
+
+	srand(1963);
+
+	for(size_t i = 0; i < frames; i++)
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++) {
+			int32_t v = rand() % (1 << field_bits[f]) - (1 << (field_bits[f] - 1));
+
+			rows[i * TLM_FIELD_COUNT + f] = v;
+			columns[f][i] = v;
+		}
+}
+
+// The pre-schema payload.cpp path: pack_int into two uint64_t groups, then unpack_int a byte at a time.
+void legacy_pack(const int64_t* v, uint8_t* data) {
+	uint64_t group1 = 0;
+	uint64_t group2 = 0;
+
+	for(size_t f = 0; f < TLM_GZ; f++)
+		pack_int(group1, v[f], field_bits[f]);
+	pack_int(group1, v[TLM_GZ], 11);
+
+	for(size_t f = TLM_GZ; f < TLM_FIELD_COUNT; f++)
+		pack_int(group2, v[f], field_bits[f]);
+
+	data[0] = FRAME_START;
+	for(size_t i = 0; i < 8; i++)
+		data[1 + i] = (uint8_t)unpack_int(group1, 8, false);
+	for(size_t i = 0; i < 8; i++)
+		data[9 + i] = (uint8_t)unpack_int(group2, 8, false);
+	data[17] = FRAME_END;
+}
+
+void legacy_unpack(const uint8_t* data, int64_t* v) {
+	uint64_t group1 = 0;
+	uint64_t group2 = 0;
+
+	for(size_t i = 0; i < 8; i++) {
+		pack_int(group1, data[1 + i], 8);
+		pack_int(group2, data[9 + i], 8);
+	}
+
+	for(size_t f = 0; f < TLM_GZ; f++)
+		v[f] = unpack_int(group1, field_bits[f], f >= TLM_AX);
+	v[TLM_GZ] = unpack_int(group1, 11);
+
+	unpack_int(group2, 1);
+	for(size_t f = TLM_ROLL; f < TLM_FIELD_COUNT; f++)
+		v[f] = unpack_int(group2, field_bits[f], f != TLM_ALT && f != TLM_VOLTS && f != TLM_SEQ);
+}
+
+void bench_packing() {
+	const size_t frames = 4096;
+	size_t rounds = iterations / frames + 1;
+	size_t total = rounds * frames;
+
+	std::vector<int64_t> rows;
+	std::vector<std::vector<int32_t> > columns;
+	std::vector<uint8_t> out(frames * FRAME_LEN);
+	int64_t values[TLM_FIELD_COUNT];
+
+	fill_samples(rows, columns, frames);
+
+	const int32_t* cols[TLM_FIELD_COUNT];
+	for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+		cols[f] = columns[f].data();
+
+	puts("Telemetry frame packing:");
+
+	bench_clock::time_point start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++)
+		for(size_t i = 0; i < frames; i++)
+			legacy_pack(&rows[i * TLM_FIELD_COUNT], &out[i * FRAME_LEN]);
+	sink += out[rounds % frames];
+	report("pack_int (legacy)", elapsed_ns(start), total, total * FRAME_LEN);
+
+	start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++)
+		for(size_t i = 0; i < frames; i++)
+			tlm_schema::pack_frame(&rows[i * TLM_FIELD_COUNT], &out[i * FRAME_LEN]);
+	sink += out[rounds % frames];
+	report("tlm_schema::pack_frame", elapsed_ns(start), total, total * FRAME_LEN);
+
+	start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++)
+		tlm_schema::pack_columns(cols, frames, out.data());
+	sink += out[rounds % frames];
+	report("tlm_schema::pack_columns", elapsed_ns(start), total, total * FRAME_LEN);
+
+	start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++)
+		for(size_t i = 0; i < frames; i++) {
+			legacy_unpack(&out[i * FRAME_LEN], values);
+			sink += values[TLM_ALT];
+		}
+	report("unpack_int (legacy)", elapsed_ns(start), total, total * FRAME_LEN);
+
+	start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++)
+		for(size_t i = 0; i < frames; i++) {
+			tlm_schema::unpack(&out[i * FRAME_LEN + 1], values);
+			sink += values[TLM_ALT];
+		}
+	report("tlm_schema::unpack", elapsed_ns(start), total, total * FRAME_LEN);
+
+	start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++) {
+		bit_writer bw(out.data());
+		for(size_t i = 0; i < frames; i++)
+			for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+				bw.put(rows[i * TLM_FIELD_COUNT + f], field_bits[f]);
+		sink += bw.finish();
+	}
+	report("bit_writer (runtime widths)", elapsed_ns(start), total, total * (FRAME_LEN - 2));
+}
+
+// Radio packets of as many frames as fit alongside their parity, clean and with the worst
+// correctable damage (FEC_PARITY / 2 bytes in every codeword).
+void bench_fec() {
+	const size_t per_packet = fec_max_data(FEC_MAX_PACKET) / FRAME_LEN;
+	const size_t len = per_packet * FRAME_LEN;
+	const size_t packets = 64;
+	size_t rounds = iterations / (packets * per_packet) + 1;
+	size_t total = rounds * packets * per_packet;
+
+	std::vector<int64_t> rows;
+	std::vector<std::vector<int32_t> > columns;
+	std::vector<uint8_t> data(packets * len);
+	std::vector<uint8_t> coded(packets * FEC_MAX_PACKET);
+	std::vector<uint8_t> damaged(packets * FEC_MAX_PACKET);
+	size_t coded_len = fec_encoded_len(len);
+	size_t data_len;
+
+	fill_samples(rows, columns, packets * per_packet);
+	for(size_t i = 0; i < packets * per_packet; i++)
+		tlm_schema::pack_frame(&rows[i * TLM_FIELD_COUNT], &data[i * FRAME_LEN]);
+
+	printf("\nReed-Solomon FEC, %zu frames (%zu bytes) + %zu parity per packet:\n", per_packet, len, coded_len - len);
+
+	bench_clock::time_point start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++)
+		for(size_t p = 0; p < packets; p++)
+			sink += fec_encode(&data[p * len], len, &coded[p * FEC_MAX_PACKET]);
+	report("fec_encode", elapsed_ns(start), total, total * FRAME_LEN);
+
+	start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++)
+		for(size_t p = 0; p < packets; p++)
+			sink += fec_decode(&coded[p * FEC_MAX_PACKET], coded_len, data_len);
+	report("fec_decode (clean)", elapsed_ns(start), total, total * FRAME_LEN);
+
+	// Corrupt FEC_PARITY / 2 consecutive stripes, i.e. that many bytes of every codeword.
+	size_t depth = fec_depth(len);
+	srand(1963);
+
+	for(size_t p = 0; p < packets; p++) {
+		uint8_t* d = &damaged[p * FEC_MAX_PACKET];
+		memcpy(d, &coded[p * FEC_MAX_PACKET], coded_len);
+
+		size_t at = rand() % (coded_len - depth * FEC_PARITY / 2);
+		for(size_t i = 0; i < depth * FEC_PARITY / 2; i++)
+			d[at + i] ^= 1 + rand() % 255;
+	}
+
+	int failures = 0;
+	start = bench_clock::now();
+	for(size_t r = 0; r < rounds; r++)
+		for(size_t p = 0; p < packets; p++) {
+			memcpy(&coded[p * FEC_MAX_PACKET], &damaged[p * FEC_MAX_PACKET], coded_len);
+			failures += fec_decode(&coded[p * FEC_MAX_PACKET], coded_len, data_len) < 0;
+		}
+	report("fec_decode (max errors)", elapsed_ns(start), total, total * FRAME_LEN);
+
+	for(size_t p = 0; p < packets; p++)
+		if(memcmp(&coded[p * FEC_MAX_PACKET], &data[p * len], len))
+			failures++;
+
+	if(failures)
+		printf("  FEC: %d packets failed to decode!\n", failures);
+}
+
+// Frame resync over two kinds of stream: back-to-back frames (recorder dump, --sink binary) and
+// noise with a frame every ~200 bytes (raw SDR capture). The noise is biased towards delimiter
+// bytes so false starts are common.
+void bench_scan() {
+	const size_t len = 64 << 20;
+	std::vector<uint8_t> dense(len), sparse(len);
+	std::vector<size_t> offsets(len / FRAME_LEN + 1);
+	size_t rounds = iterations / 1000000 + 1;
+	size_t resume, found = 0;
+
+	srand(1963);
+
+	for(size_t i = 0; i + FRAME_LEN <= len; i += FRAME_LEN) {
+		for(size_t j = 1; j < FRAME_LEN - 1; j++)
+			dense[i + j] = rand();
+		dense[i] = FRAME_START;
+		dense[i + FRAME_LEN - 1] = FRAME_END;
+	}
+
+	for(size_t i = 0; i < len; i++) {
+		int r = rand() % 16;
+		sparse[i] = r == 0 ? FRAME_START : (r == 1 ? FRAME_END : rand());
+	}
+	for(size_t i = 0; i + FRAME_LEN <= len; i += 150 + rand() % 100) {
+		sparse[i] = FRAME_START;
+		sparse[i + FRAME_LEN - 1] = FRAME_END;
+	}
+
+#if defined(__SSE2__)
+	const char* isa = "SSE2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const char* isa = "NEON";
+#else
+	const char* isa = "no SIMD";
+#endif
+
+	printf("\nFrame scanner (%s), %zu MiB streams:\n", isa, len >> 20);
+
+	const std::vector<uint8_t>* streams[] = {&dense, &sparse};
+	const char* names[] = {"back-to-back", "noisy capture"};
+
+	for(int s = 0; s < 2; s++) {
+		const uint8_t* data = streams[s]->data();
+
+		bench_clock::time_point start = bench_clock::now();
+		for(size_t r = 0; r < rounds; r++)
+			found = scan_frames(data, len, offsets.data(), offsets.size(), resume);
+		double simd = elapsed_ns(start) / rounds;
+		sink += found;
+
+		size_t simd_found = found;
+
+		start = bench_clock::now();
+		for(size_t r = 0; r < rounds; r++)
+			found = scan_frames_scalar(data, len, offsets.data(), offsets.size(), resume);
+		double scalar = elapsed_ns(start) / rounds;
+		sink += found;
+
+		printf("  %-14s %9zu frames  scan_frames %6.2f GB/s  scalar %6.2f GB/s%s\n", names[s], found, len / simd, len / scalar,
+			simd_found == found ? "" : "  MISMATCH");
+	}
+}
+
+int main(int argc, const char* argv[]) {
+	if(argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+
+	printf("TECS microbenchmarks, %zu iterations.\n\n", iterations);
+
+	bench_packing();
+	bench_fec();
+	bench_scan();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// MSB-first bit stream writer/reader.
+//
+// Unlike pack_int/unpack_int in common.h, which shift one field at a time through a single
+// uint64_t and then need another pass to peel bytes off, these accumulate into a 64-bit
+// register and hit memory with one big-endian 8-byte store (or load) per 64 bits.
+
+static inline void store_be64(uint8_t* out, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	memcpy(out, &v, sizeof(v));
+}
+
+static inline void store_be32(uint8_t* out, uint32_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	memcpy(out, &v, sizeof(v));
+}
+
+static inline uint32_t load_be32(const uint8_t* in) {
+	uint32_t v;
+	memcpy(&v, in, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t load_be64(const uint8_t* in) {
+	uint64_t v;
+	memcpy(&v, in, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint64_t bit_mask(size_t bits) {
+	return bits >= 64 ? 0xFFFFFFFFFFFFFFFF : (((uint64_t)1 << bits) - 1);
+}
+
+class bit_writer {
+public:
+	// The caller guarantees out has room for the bits written, rounded up to whole bytes.
+	bit_writer(uint8_t* out) : out(out), pos(0), acc(0), used(0) {}
+
+	// Appends the low `bits` bits of value (1 - 64).
+	inline void put(uint64_t value, size_t bits) {
+		value &= bit_mask(bits);
+
+		if(used + bits < 64) {
+			acc |= value << (64 - used - bits);
+			used += bits;
+			return;
+		}
+
+		size_t spill = used + bits - 64; // Bits that don't fit in the current word.
+
+		acc |= value >> spill;
+		store_be64(out + pos, acc);
+		pos += 8;
+
+		acc = spill ? value << (64 - spill) : 0;
+		used = spill;
+	}
+
+	// Flushes the partial word and returns the total number of bytes written.
+	size_t finish() {
+		size_t tail = (used + 7) / 8;
+
+		for(size_t i = 0; i < tail; i++)
+			out[pos + i] = (uint8_t)(acc >> (56 - 8 * i));
+
+		pos += tail;
+		acc = 0;
+		used = 0;
+
+		return pos;
+	}
+
+	// Bits written so far, including the unflushed ones.
+	size_t bits() const { return pos * 8 + used; }
+
+private:
+	uint8_t* out;
+	size_t pos;
+	uint64_t acc;
+	size_t used;
+};
+
+class bit_reader {
+public:
+	bit_reader(const uint8_t* in, size_t len) : in(in), len(len), pos(0), acc(0), avail(0), overrun(false) {}
+
+	// Reads `bits` bits (1 - 64) as unsigned. Reading past the end returns zeros and sets overrun.
+	inline uint64_t get(size_t bits) {
+		if(bits <= avail) {
+			uint64_t ret = acc >> (64 - bits);
+			acc = bits == 64 ? 0 : acc << bits;
+			avail -= bits;
+			return ret;
+		}
+
+		size_t need = bits - avail;
+		uint64_t ret = avail ? (acc >> (64 - avail)) << need : 0;
+
+		refill();
+
+		if(need > avail) {
+			overrun = true;
+			need = avail;
+		}
+
+		if(need) {
+			ret |= acc >> (64 - need);
+			acc = need == 64 ? 0 : acc << need;
+			avail -= need;
+		}
+
+		return ret;
+	}
+
+	// Reads `bits` bits and sign-extends them.
+	inline int64_t get_signed(size_t bits) {
+		uint64_t raw = get(bits);
+
+		if(bits < 64 && (raw & ((uint64_t)1 << (bits - 1))))
+			raw |= 0xFFFFFFFFFFFFFFFF << bits;
+
+		return (int64_t)raw;
+	}
+
+	bool failed() const { return overrun; }
+
+	// Bits consumed so far.
+	size_t bits() const { return pos * 8 - avail; }
+
+private:
+	inline void refill() {
+		if(len - pos >= 8) {
+			acc = load_be64(in + pos);
+			pos += 8;
+			avail = 64;
+			return;
+		}
+
+		acc = 0;
+		avail = 0;
+
+		for(size_t i = 0; pos < len; i++, pos++) {
+			acc |= (uint64_t)in[pos] << (56 - 8 * i);
+			avail += 8;
+		}
+	}
+
+	const uint8_t* in;
+	size_t len;
+	size_t pos;
+	uint64_t acc;
+	size_t avail;
+	bool overrun;
+};
+
+#endif //BITSTREAM_H
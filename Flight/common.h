@@ -2,15 +2,40 @@
 #define COMMON_H
 
 #define NETWORK_PORT 1963
+#define GROUND_PORT 40868 // irec2018_gr.py's UDP sink, where tecs-recv listens.
 
 // ERROR CODES
-#define ERR_MPU_MAIN_NULL 0
-#define ERR_MPU_MAIN_INIT_FAIL 0
-#define ERR_BARO_INIT_FAIL 0
-#define ERR_BARO_NULL 0
-#define ERR_MPU_AUX_NULL 0
-#define ERR_MPU_AUX_INIT_FAIL 0
-#define ERR_BCM_INIT_FAIL 0
+// 6 bits, so one fits the TLM_ERR telemetry field; 0 is no error. Names are in events.h.
+#define ERR_MPU_MAIN_NULL 1
+#define ERR_MPU_MAIN_INIT_FAIL 2
+#define ERR_BARO_INIT_FAIL 3
+#define ERR_BARO_NULL 4
+#define ERR_MPU_AUX_NULL 5
+#define ERR_MPU_AUX_INIT_FAIL 6
+#define ERR_BCM_INIT_FAIL 7
+#define ERR_BLACKBOX_FAIL 8
+#define ERR_FLIGHTLOG_FAIL 9
+#define ERR_NET_INIT_FAIL 10
+
+// In flight.
+#define ERR_IMU_MAIN_FAILED 16
+#define ERR_IMU_AUX_FAILED 17
+#define ERR_FUSION_HOLDING 18
+#define ERR_SCHED_OVERRUN 19
+#define ERR_TX_DROPPED 20
+#define ERR_BLACKBOX_DROPPED 21
+#define ERR_FLIGHTLOG_DROPPED 22
+#define ERR_BATTERY_LOW 23 // arg: volts x 10.
+#define ERR_BATTERY_ADC 24
+
+// Radio.
+#define ERR_RF_QUEUE_DROPPED 32
+#define ERR_UDP_TRUNCATED 33
+#define ERR_LINK_LOST 34
+
+// Events: sent as event frames, never in TLM_ERR.
+#define EVT_PHASE 48 // arg: the new flight phase.
+#define EVT_MODEM_PROFILE 49 // arg: the new modem profile.
 
 // Yes I know this is bad practice. Yes I know this could fail terribly. I'm doing it anyways.
 // We're only working with single files here.
@@ -42,4 +67,29 @@ int64_t unpack_int(uint64_t& box, size_t size, bool retsigned = true) {
 	return ret;
 }
 
+// CRC-32 (IEEE 802.3, reflected, poly 0xEDB88320). Pass the previous return value as crc to
+// continue a running checksum across buffers.
+struct crc32_table {
+	uint32_t entry[256];
+
+	crc32_table() {
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for(int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			entry[i] = c;
+		}
+	}
+};
+
+uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc = 0) {
+	static const crc32_table table; // Built once, thread-safely, on first use.
+
+	crc = ~crc;
+	for(size_t i = 0; i < len; i++)
+		crc = table.entry[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
 #endif //COMMON_H
\ No newline at end of file
@@ -0,0 +1,194 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "bitstream.h"
+#include "telemetry.h"
+
+// Keyframe + delta telemetry encoding (payload --delta).
+//
+// Every keyframe_interval-th sample goes out as an ordinary 0x5e...0xd5 frame. The samples in
+// between go out as delta records against the previous sample:
+//
+//     DELTA_START <seq> <per-field codes, MSB first, zero-padded to a byte>
+//
+// seq is the full TLM_SEQ of the sample. Each other field, in schema order, is coded as
+//     0                      unchanged
+//     10  + 2 bits           zigzag delta of +/-1 or +/-2 (stored minus one)
+//     110 + ceil(bits/2)     zigzag delta
+//     111 + bits             the new raw value
+// Deltas are taken modulo the field width, so wrapping fields (seq, yaw) cost nothing extra.
+// The code is self-delimiting, so records can be concatenated in one datagram or radio packet.
+// A record that would come out longer than a frame is sent as a keyframe instead.
+//
+// The decoder only applies a delta whose seq directly follows the last sample it reconstructed, so
+// a lost packet costs at most keyframe_interval samples. One that doesn't follow on is not
+// consumed and the chain is kept: it may be a stray DELTA_START in noise with the real record
+// starting inside it, so the caller resyncs from the next byte. The same goes for one that does
+// follow on but has a keyframe, or a delta with the same seq, starting inside it.
+
+#define DELTA_START 0x5c
+#define DELTA_HEADER_LEN 2
+#define DELTA_KEYFRAME_INTERVAL 16
+
+class delta_encoder {
+public:
+	delta_encoder(unsigned keyframe_interval = DELTA_KEYFRAME_INTERVAL) : interval(keyframe_interval ? keyframe_interval : 1), count(0) {}
+
+	// Encodes one sample (values[TLM_FIELD_COUNT], TLM_SEQ filled in) into out, which must hold
+	// FRAME_LEN bytes. Returns the number of bytes written.
+	size_t encode(const int64_t* values, uint8_t* out) {
+		uint64_t raw[TLM_FIELD_COUNT];
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+			raw[f] = (uint64_t)values[f] & bit_mask(tlm_schema::field_bits(f));
+
+		size_t len = 0;
+
+		if(count++ % interval != 0) {
+			bit_writer bw(out + DELTA_HEADER_LEN);
+
+			for(size_t f = 0; f < TLM_FIELD_COUNT && bw.bits() <= 8 * (FRAME_LEN - DELTA_HEADER_LEN); f++)
+				if(f != TLM_SEQ)
+					put_field(bw, raw[f], prev[f], tlm_schema::field_bits(f));
+
+			// Checked against the bit count first: bw must not run past the end of out.
+			if(bw.bits() <= 8 * (FRAME_LEN - DELTA_HEADER_LEN)) {
+				len = DELTA_HEADER_LEN + bw.finish();
+				out[0] = DELTA_START;
+				out[1] = (uint8_t)raw[TLM_SEQ];
+			}
+		}
+
+		if(len == 0 || len >= FRAME_LEN) {
+			tlm_schema::pack_frame(values, out);
+			len = FRAME_LEN;
+			count = 1;
+		}
+
+		memcpy(prev, raw, sizeof(prev));
+		return len;
+	}
+
+	// True if the next encode() will be a keyframe.
+	bool keyframe_next() const { return count % interval == 0; }
+
+private:
+	static void put_field(bit_writer& bw, uint64_t cur, uint64_t last, size_t bits) {
+		if(cur == last) {
+			bw.put(0, 1);
+			return;
+		}
+
+		uint64_t z = zigzag(cur - last, bits);
+		size_t half = (bits + 1) / 2;
+
+		if(z <= 4) {
+			bw.put(0x2, 2);
+			bw.put(z - 1, 2);
+		} else if(z < ((uint64_t)1 << half)) {
+			bw.put(0x6, 3);
+			bw.put(z, half);
+		} else {
+			bw.put(0x7, 3);
+			bw.put(cur, bits);
+		}
+	}
+
+	// Delta modulo 2^bits, taken as signed, then zigzagged: 0, -1, 1, -2, 2... -> 0, 1, 2, 3, 4...
+	static uint64_t zigzag(uint64_t diff, size_t bits) {
+		int64_t d = (int64_t)(diff << (64 - bits)) >> (64 - bits);
+		return ((uint64_t)d << 1 ^ (uint64_t)(d >> 63)) & bit_mask(bits);
+	}
+
+	unsigned interval;
+	unsigned count;
+	uint64_t prev[TLM_FIELD_COUNT];
+};
+
+class delta_decoder {
+public:
+	delta_decoder() : have_prev(false) {}
+
+	// Decodes the keyframe or delta record at the start of data. Returns the bytes it occupies (0 if
+	// data doesn't start with a complete record) and sets ok if values[TLM_FIELD_COUNT] holds a
+	// reconstructed sample. A delta that doesn't follow on from the last sample, or that has another
+	// candidate record inside it, leaves ok false and the decoder unchanged; don't skip its bytes,
+	// they may hold the next real record.
+	size_t decode(const uint8_t* data, size_t len, int64_t* values, bool& ok) {
+		ok = false;
+
+		if(len >= FRAME_LEN && data[0] == FRAME_START && data[FRAME_LEN - 1] == FRAME_END) {
+			tlm_schema::unpack(data + 1, values);
+
+			for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+				prev[f] = (uint64_t)values[f] & bit_mask(tlm_schema::field_bits(f));
+
+			have_prev = ok = true;
+			return FRAME_LEN;
+		}
+
+		if(len < DELTA_HEADER_LEN + 1 || data[0] != DELTA_START)
+			return 0;
+
+		uint64_t raw[TLM_FIELD_COUNT];
+		bit_reader br(data + DELTA_HEADER_LEN, len - DELTA_HEADER_LEN);
+
+		raw[TLM_SEQ] = data[1];
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+			if(f != TLM_SEQ)
+				raw[f] = get_field(br, prev[f], tlm_schema::field_bits(f));
+
+		if(br.failed())
+			return 0;
+
+		size_t used = DELTA_HEADER_LEN + (br.bits() + 7) / 8;
+
+		if(!have_prev || raw[TLM_SEQ] != ((prev[TLM_SEQ] + 1) & bit_mask(tlm_schema::field_bits(TLM_SEQ))))
+			return used;
+
+		// A DELTA_START in noise followed by the right seq byte by chance (1 in 256) decodes as
+		// garbage, and the real record then starts inside it. Defer to one that does.
+		for(size_t j = 1; j < used; j++)
+			if((data[j] == DELTA_START && j + 1 < len && data[j + 1] == data[1]) ||
+			   (data[j] == FRAME_START && len - j >= FRAME_LEN && data[j + FRAME_LEN - 1] == FRAME_END))
+				return used;
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++) {
+			size_t bits = tlm_schema::field_bits(f);
+
+			prev[f] = raw[f];
+			values[f] = tlm_schema::field_signed(f) ? (int64_t)(raw[f] << (64 - bits)) >> (64 - bits) : (int64_t)raw[f];
+		}
+
+		ok = true;
+		return used;
+	}
+
+private:
+	static uint64_t get_field(bit_reader& br, uint64_t last, size_t bits) {
+		if(br.get(1) == 0)
+			return last;
+
+		uint64_t z;
+
+		if(br.get(1) == 0)
+			z = br.get(2) + 1;
+		else if(br.get(1) == 0)
+			z = br.get((bits + 1) / 2);
+		else
+			return br.get(bits);
+
+		uint64_t d = (z >> 1) ^ (0 - (z & 1)); // Un-zigzag.
+		return (last + d) & bit_mask(bits);
+	}
+
+	bool have_prev;
+	uint64_t prev[TLM_FIELD_COUNT];
+};
+
+#endif //DELTA_H
@@ -0,0 +1,218 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+
+#include <atomic>
+
+#include "bitstream.h"
+#include "common.h"
+#include "spsc.h"
+
+// Error and event reporting for payload and radio.
+//
+// error() pushes an event_record into an event_ring and returns. Any thread may push: a slot is
+// claimed with one fetch_add, filled, and published with its sequence number, so pushing never
+// blocks, never allocates and never waits on a reader. Messages are string literals, stored as
+// pointers. When the ring is full the oldest record is overwritten. An error code that was pushed
+// less than EVT_REPEAT_US ago is suppressed and counted, so an error raised on every sample costs
+// one record a second, not the ring.
+//
+// Readers each keep a cursor and see every record in order. A reader that falls more than
+// the ring size behind skips ahead and counts what it lost. Each slot is a seqlock: a reader copies
+// the record and then checks that the sequence number hasn't moved under it.
+//
+// Codes are the ERR_*/EVT_* values in common.h. They are 6 bits so one fits the TLM_ERR field.
+// Over the radio, an event goes out as a fixed 12 byte record between telemetry frames:
+//
+//     EVENT_START <code> <flags> <arg, int32 BE> <time, ms, uint32 BE> EVENT_END
+
+#define EVT_FATAL 0x01
+#define EVT_NORADIO 0x02 // Console only: not in TLM_ERR or an event frame.
+#define EVT_INFO 0x04 // An event, not an error: sent as an event frame but not in TLM_ERR.
+
+#define EVT_RING_SIZE 64
+#define EVT_REPEAT_US 1000000
+#define EVT_CODES 64
+
+#define EVENT_START 0x5b
+#define EVENT_END 0xb5
+#define EVENT_LEN 12
+
+struct event_record {
+	uint64_t timestamp; // st_read()
+	uint8_t code;
+	uint8_t flags;
+	int32_t arg;
+	const char* message;
+};
+
+static inline const char* event_name(uint8_t code) {
+	switch(code) {
+	case ERR_MPU_MAIN_NULL: return "mpu_main missing";
+	case ERR_MPU_MAIN_INIT_FAIL: return "mpu_main init";
+	case ERR_BARO_INIT_FAIL: return "baro init";
+	case ERR_BARO_NULL: return "baro missing";
+	case ERR_MPU_AUX_NULL: return "mpu_aux missing";
+	case ERR_MPU_AUX_INIT_FAIL: return "mpu_aux init";
+	case ERR_BCM_INIT_FAIL: return "bcm2835 init";
+	case ERR_BLACKBOX_FAIL: return "black box open";
+	case ERR_FLIGHTLOG_FAIL: return "flight log open";
+	case ERR_NET_INIT_FAIL: return "network init";
+	case ERR_IMU_MAIN_FAILED: return "mpu_main failed over";
+	case ERR_IMU_AUX_FAILED: return "mpu_aux failed over";
+	case ERR_FUSION_HOLDING: return "no usable IMU";
+	case ERR_SCHED_OVERRUN: return "acquisition overrun";
+	case ERR_TX_DROPPED: return "TX queue overflow";
+	case ERR_BLACKBOX_DROPPED: return "black box dropped";
+	case ERR_FLIGHTLOG_DROPPED: return "flight log dropped";
+	case ERR_BATTERY_LOW: return "battery low";
+	case ERR_BATTERY_ADC: return "battery ADC";
+	case ERR_RF_QUEUE_DROPPED: return "RF queue overflow";
+	case ERR_UDP_TRUNCATED: return "datagram over MTU";
+	case ERR_LINK_LOST: return "ground link lost";
+	case EVT_PHASE: return "flight phase";
+	case EVT_MODEM_PROFILE: return "modem profile";
+	default: return "?";
+	}
+}
+
+template<size_t N>
+class event_ring {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "event_ring size must be a power of two");
+
+public:
+	event_ring() : head(0), suppressed_count(0) {
+		for(size_t i = 0; i < N; i++)
+			slots[i].seq.store(0, std::memory_order_relaxed);
+
+		for(size_t i = 0; i < EVT_CODES; i++)
+			last[i].store(0, std::memory_order_relaxed);
+	}
+
+	// Returns false if the code repeated within EVT_REPEAT_US and was suppressed. Fatal errors and
+	// EVT_INFO events always go in.
+	bool push(uint8_t code, uint8_t flags, int32_t arg, const char* message, uint64_t now) {
+		code &= EVT_CODES - 1;
+
+		if(!(flags & (EVT_FATAL | EVT_INFO))) {
+			uint64_t prev = last[code].load(std::memory_order_relaxed);
+
+			if((prev != 0 && now - prev < EVT_REPEAT_US) || !last[code].compare_exchange_strong(prev, now ? now : 1, std::memory_order_relaxed)) {
+				suppressed_count.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+
+		uint64_t i = head.fetch_add(1, std::memory_order_relaxed);
+		slot& s = slots[i & (N - 1)];
+
+		s.seq.store(2 * i + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		s.timestamp.store(now, std::memory_order_relaxed);
+		s.info.store((uint64_t)code | (uint64_t)flags << 8 | (uint64_t)(uint32_t)arg << 32, std::memory_order_relaxed);
+		s.message.store(message, std::memory_order_relaxed);
+
+		s.seq.store(2 * i + 2, std::memory_order_release);
+		return true;
+	}
+
+	struct cursor {
+		cursor() : next(0), lost(0) {}
+
+		uint64_t next;
+		uint64_t lost; // Overwritten before this reader got to them.
+	};
+
+	// Next record for this reader, if there is one.
+	bool read(cursor& c, event_record& r) const {
+		for(;;) {
+			uint64_t h = head.load(std::memory_order_acquire);
+
+			if(c.next >= h)
+				return false;
+
+			if(h - c.next > N) {
+				c.lost += h - N - c.next;
+				c.next = h - N;
+			}
+
+			const slot& s = slots[c.next & (N - 1)];
+			uint64_t seq = s.seq.load(std::memory_order_acquire);
+
+			// Claimed but not published yet.
+			if(seq < 2 * c.next + 2)
+				return false;
+
+			uint64_t info = s.info.load(std::memory_order_relaxed);
+			r.timestamp = s.timestamp.load(std::memory_order_relaxed);
+			r.message = s.message.load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			// Overwritten by a later lap, before or while we copied it.
+			if(seq != 2 * c.next + 2 || s.seq.load(std::memory_order_relaxed) != seq) {
+				c.next++;
+				c.lost++;
+				continue;
+			}
+
+			r.code = info & 0xFF;
+			r.flags = (info >> 8) & 0xFF;
+			r.arg = (int32_t)(uint32_t)(info >> 32);
+			c.next++;
+			return true;
+		}
+	}
+
+	uint64_t pushed() const { return head.load(std::memory_order_relaxed); }
+	uint64_t suppressed() const { return suppressed_count.load(std::memory_order_relaxed); }
+
+private:
+	struct slot {
+		std::atomic<uint64_t> seq; // 2i + 1 while record i is written, 2i + 2 once it's complete.
+		std::atomic<uint64_t> timestamp;
+		std::atomic<uint64_t> info; // code | flags << 8 | arg << 32
+		std::atomic<const char*> message;
+	};
+
+	alignas(CACHE_LINE) std::atomic<uint64_t> head;
+	std::atomic<uint64_t> suppressed_count;
+	std::atomic<uint64_t> last[EVT_CODES]; // Last push per code, for the repeat limit.
+	alignas(CACHE_LINE) slot slots[N];
+};
+
+// EVENT_LEN bytes. The timestamp goes out in ms and wraps after 49 days.
+static inline void event_pack(const event_record& r, uint8_t* out) {
+	out[0] = EVENT_START;
+	out[1] = r.code;
+	out[2] = r.flags;
+	store_be32(out + 3, (uint32_t)r.arg);
+	store_be32(out + 7, (uint32_t)(r.timestamp / 1000));
+	out[EVENT_LEN - 1] = EVENT_END;
+}
+
+// Returns false if data doesn't start with an event record. The message doesn't travel; it's
+// replaced by event_name().
+static inline bool event_parse(const uint8_t* data, size_t len, event_record& r) {
+	if(len < EVENT_LEN || data[0] != EVENT_START || data[EVENT_LEN - 1] != EVENT_END || data[1] >= EVT_CODES)
+		return false;
+
+	r.code = data[1];
+	r.flags = data[2];
+	r.arg = (int32_t)load_be32(data + 3);
+	r.timestamp = (uint64_t)load_be32(data + 7) * 1000;
+	r.message = event_name(r.code);
+	return true;
+}
+
+static inline void event_print(FILE* out, const event_record& r) {
+	const char* kind = r.flags & EVT_FATAL ? "*FATAL*" : r.flags & EVT_INFO ? " EVENT " : " ERROR ";
+
+	fprintf(out, "%s: %s (%s, %d) at %.3f s\n", kind, r.message, event_name(r.code), r.arg, r.timestamp / 1e6);
+}
+
+#endif //EVENTS_H
@@ -0,0 +1,303 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "bitstream.h"
+
+// Forward error correction for radio packets (radio --fec).
+//
+// Reed-Solomon over GF(256) (poly 0x11d, first root alpha^0), FEC_PARITY check bytes per codeword,
+// so each codeword corrects up to FEC_PARITY / 2 byte errors. A packet of len data bytes is split
+// into fec_depth(len) codewords by striping: data byte j belongs to codeword j % depth. Parity is
+// appended after the data, striped the same way. A burst of corrupted bytes on air is therefore
+// spread across every codeword instead of wiping out one, and frames that span codewords are
+// protected as a whole.
+//
+// The code is systematic: the data part of the packet is sent unchanged, so a receiver that
+// doesn't know about FEC still finds its 0x5e...0xd5 frames and just ignores the trailing parity.
+//
+// Both the data length and the depth are recovered from the packet length alone, since
+// fec_encoded_len() is strictly increasing in len.
+
+#define FEC_PARITY 16 // Fixed: rs_encode keeps the parity in two uint64_t.
+#define FEC_CHUNK 64 // Max data bytes per codeword. Sets the overhead: 16 parity per 64 data.
+#define FEC_MAX_CODEWORD 255
+#define FEC_MAX_PACKET 255 // One RF95 FIFO.
+
+static_assert(FEC_PARITY == 16, "rs_encode's parity register is two uint64_t");
+static_assert(FEC_CHUNK + FEC_PARITY <= FEC_MAX_CODEWORD, "codeword too long for GF(256)");
+
+struct gf256 {
+	uint8_t exp[512]; // Doubled so exp[log a + log b] needs no modulo.
+	uint8_t log[256];
+	uint64_t gen_hi[256]; // Every byte times the generator coefficients below the leading 1,
+	uint64_t gen_lo[256]; // packed big-endian into the two halves of the parity register.
+
+	gf256() {
+		unsigned x = 1;
+		for(int i = 0; i < 255; i++) {
+			exp[i] = exp[i + 255] = x;
+			log[x] = i;
+			x <<= 1;
+			if(x & 0x100)
+				x ^= 0x11d;
+		}
+		exp[510] = exp[511] = exp[0];
+		log[0] = 0; // Never used; every caller checks for zero.
+
+		// g(x) = (x - a^0)(x - a^1)...(x - a^(P-1)), highest power first.
+		uint8_t g[FEC_PARITY + 1] = {1};
+		for(int r = 0; r < FEC_PARITY; r++) {
+			for(int i = r + 1; i > 0; i--)
+				g[i] = g[i] ^ mul(g[i - 1], exp[r]);
+		}
+
+		for(int a = 0; a < 256; a++) {
+			gen_hi[a] = gen_lo[a] = 0;
+			for(int i = 0; i < 8; i++) {
+				gen_hi[a] = gen_hi[a] << 8 | mul(a, g[i + 1]);
+				gen_lo[a] = gen_lo[a] << 8 | mul(a, g[i + 9]);
+			}
+		}
+	}
+
+	uint8_t mul(uint8_t a, uint8_t b) const { return a && b ? exp[log[a] + log[b]] : 0; }
+	uint8_t div(uint8_t a, uint8_t b) const { return a ? exp[log[a] + 255 - log[b]] : 0; }
+};
+
+static const gf256& gf() {
+	static const gf256 field; // Built once, thread-safely, on first use.
+	return field;
+}
+
+// Computes the FEC_PARITY check bytes for k <= FEC_MAX_CODEWORD - FEC_PARITY message bytes.
+// The 16-byte LFSR lives in two uint64_t registers, so each message byte is two table lookups.
+void rs_encode(const uint8_t* msg, size_t k, uint8_t* parity) {
+	const gf256& f = gf();
+	uint64_t hi = 0, lo = 0;
+
+	for(size_t i = 0; i < k; i++) {
+		uint8_t feedback = msg[i] ^ (hi >> 56);
+
+		hi = (hi << 8 | lo >> 56) ^ f.gen_hi[feedback];
+		lo = lo << 8 ^ f.gen_lo[feedback];
+	}
+
+	store_be64(parity, hi);
+	store_be64(parity + 8, lo);
+}
+
+// Corrects a codeword of n bytes (message then parity) in place. Returns the number of bytes
+// corrected, or -1 if there were more errors than the code can fix.
+int rs_decode(uint8_t* cw, size_t n) {
+	const gf256& f = gf();
+	uint8_t s[FEC_PARITY];
+	bool clean = true;
+
+	if(n <= FEC_PARITY)
+		return -1;
+
+	// Fast path for the usual case: re-encoding is much cheaper than the syndromes.
+	rs_encode(cw, n - FEC_PARITY, s);
+	if(memcmp(s, cw + n - FEC_PARITY, FEC_PARITY) == 0)
+		return 0;
+
+	// Syndromes: the codeword evaluated at each root of the generator.
+	for(int j = 0; j < FEC_PARITY; j++) {
+		uint8_t v = 0;
+		for(size_t i = 0; i < n; i++)
+			v = (v ? f.exp[f.log[v] + j] : 0) ^ cw[i];
+		s[j] = v;
+		clean &= v == 0;
+	}
+
+	if(clean)
+		return 0;
+
+	// Berlekamp-Massey: error locator lambda(x), lowest power first.
+	uint8_t lambda[FEC_PARITY + 1] = {1};
+	uint8_t b[FEC_PARITY + 1] = {1};
+	uint8_t t[FEC_PARITY + 1];
+	int l = 0, m = 1;
+	uint8_t bd = 1;
+
+	for(int r = 0; r < FEC_PARITY; r++) {
+		uint8_t d = s[r];
+		for(int i = 1; i <= l; i++)
+			d ^= f.mul(lambda[i], s[r - i]);
+
+		if(d == 0) {
+			m++;
+			continue;
+		}
+
+		uint8_t coef = f.div(d, bd);
+		memcpy(t, lambda, sizeof(t));
+
+		for(int i = 0; i + m <= FEC_PARITY; i++)
+			lambda[i + m] ^= f.mul(coef, b[i]);
+
+		if(2 * l <= r) {
+			l = r + 1 - l;
+			memcpy(b, t, sizeof(b));
+			bd = d;
+			m = 1;
+		} else
+			m++;
+	}
+
+	if(l > FEC_PARITY / 2)
+		return -1;
+
+	// omega(x) = s(x) * lambda(x) mod x^P.
+	uint8_t omega[FEC_PARITY] = {};
+	for(int i = 0; i < FEC_PARITY; i++)
+		for(int j = 0; j <= l && j <= i; j++)
+			omega[i] ^= f.mul(s[i - j], lambda[j]);
+
+	// Chien search over the positions that exist in this (shortened) codeword, Forney for values.
+	int found = 0;
+	int fixes[FEC_PARITY / 2];
+	uint8_t values[FEC_PARITY / 2];
+
+	for(size_t pos = 0; pos < n; pos++) {
+		int power = n - 1 - pos; // Position pos carries x^power.
+		int inv = (255 - power) % 255; // log of X^-1.
+
+		uint8_t v = 0;
+		for(int i = l; i >= 0; i--)
+			v = (v ? f.exp[f.log[v] + inv] : 0) ^ lambda[i];
+
+		if(v != 0)
+			continue;
+
+		if(found == l)
+			return -1;
+
+		uint8_t num = 0;
+		for(int i = FEC_PARITY - 1; i >= 0; i--)
+			num = (num ? f.exp[f.log[num] + inv] : 0) ^ omega[i];
+
+		// Formal derivative: only odd powers survive in characteristic 2.
+		uint8_t den = 0;
+		for(int i = 1; i <= l; i += 2)
+			den ^= lambda[i] ? f.exp[f.log[lambda[i]] + (inv * (i - 1)) % 255] : 0;
+
+		if(den == 0)
+			return -1;
+
+		fixes[found] = pos;
+		values[found] = f.mul(f.exp[power], f.div(num, den));
+		found++;
+	}
+
+	// Fewer roots than the locator's degree: the errors landed outside the codeword, i.e. too many.
+	if(found != l)
+		return -1;
+
+	for(int i = 0; i < found; i++)
+		cw[fixes[i]] ^= values[i];
+
+	return found;
+}
+
+// Number of codewords a packet of len data bytes is striped across.
+static inline size_t fec_depth(size_t len) {
+	return len == 0 ? 1 : (len + FEC_CHUNK - 1) / FEC_CHUNK;
+}
+
+static inline size_t fec_encoded_len(size_t len) {
+	return len + fec_depth(len) * FEC_PARITY;
+}
+
+// Largest data length whose encoding still fits in mtu bytes.
+static inline size_t fec_max_data(size_t mtu) {
+	size_t len = 0;
+	while(fec_encoded_len(len + 1) <= mtu)
+		len++;
+	return len;
+}
+
+// Writes data followed by its striped parity to out (which may be data). Returns the encoded length.
+size_t fec_encode(const uint8_t* data, size_t len, uint8_t* out) {
+	size_t depth = fec_depth(len);
+	uint8_t msg[FEC_MAX_CODEWORD];
+	uint8_t parity[FEC_PARITY];
+
+	if(out != data)
+		memmove(out, data, len);
+
+	for(size_t c = 0; c < depth; c++) {
+		size_t k = 0;
+		for(size_t j = c; j < len; j += depth)
+			msg[k++] = data[j];
+
+		rs_encode(msg, k, parity);
+
+		for(size_t p = 0; p < FEC_PARITY; p++)
+			out[len + p * depth + c] = parity[p];
+	}
+
+	return len + depth * FEC_PARITY;
+}
+
+// Corrects an encoded packet in place and sets data_len to the length of its data part. Returns
+// the number of bytes corrected, or -1 if the length isn't a valid encoding or any codeword was
+// beyond repair (the data is then left as received).
+int fec_decode(uint8_t* packet, size_t len, size_t& data_len) {
+	size_t depth = 0;
+
+	for(size_t d = 1; d * FEC_PARITY < len; d++)
+		if(fec_depth(len - d * FEC_PARITY) == d) {
+			depth = d;
+			break;
+		}
+
+	if(depth == 0)
+		return -1;
+
+	data_len = len - depth * FEC_PARITY;
+
+	// Work on a copy so a failure part way through leaves the packet as received.
+	uint8_t work[FEC_MAX_PACKET];
+	uint8_t cw[FEC_MAX_CODEWORD];
+	int corrected = 0;
+
+	if(len > sizeof(work))
+		return -1;
+
+	memcpy(work, packet, len);
+
+	for(size_t c = 0; c < depth; c++) {
+		size_t n = 0;
+		for(size_t j = c; j < data_len; j += depth)
+			cw[n++] = work[j];
+		for(size_t p = 0; p < FEC_PARITY; p++)
+			cw[n++] = work[data_len + p * depth + c];
+
+		int r = rs_decode(cw, n);
+		if(r < 0)
+			return -1;
+
+		if(r == 0)
+			continue;
+
+		corrected += r;
+
+		n = 0;
+		for(size_t j = c; j < data_len; j += depth)
+			work[j] = cw[n++];
+		for(size_t p = 0; p < FEC_PARITY; p++)
+			work[data_len + p * depth + c] = cw[n++];
+	}
+
+	if(corrected)
+		memcpy(packet, work, len);
+
+	return corrected;
+}
+
+#endif //FEC_H
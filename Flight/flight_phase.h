@@ -0,0 +1,250 @@
+#ifndef FLIGHT_PHASE_H
+#define FLIGHT_PHASE_H
+
+#include <cstdint>
+#include <cmath>
+
+// Onboard flight phase detection, sent as the FPS telemetry field.
+//
+// phase_detector runs on every mpu_main sample. It keeps an altitude and vertical velocity
+// estimate above the pad: every sample integrates the accelerometer, and every barometer reading
+// pulls the estimate back with a second-order complementary filter. On the way up the rocket
+// points along its velocity, so the vertical acceleration is the specific force along the
+// airframe axis minus 1 g; after apogee the only force besides gravity is drag from falling, so
+// it's the specific force magnitude minus 1 g. The barometer is ignored above mach_lockout, where
+// the shock wave upsets the static pressure, and on the pad it's averaged for the ground level.
+//
+// Phases only move forward, and each transition's condition has to hold continuously for its hold
+// time, so one noisy sample (or the motor chuffing at burnout) can't move the phase:
+//
+//   PAD     -> BOOST    accel magnitude above launch_accel, or climbing faster than launch_speed
+//   BOOST   -> BURNOUT  axial accel below burnout_accel: thrust is gone and drag is winning
+//   BURNOUT -> COAST    after burnout_us
+//   COAST   -> APOGEE   vertical velocity at or below zero
+//   APOGEE  -> DROGUE   descending faster than drogue_speed, or after apogee_us
+//   DROGUE  -> MAIN     descent slower than main_speed: the bigger canopy is out
+//   DROGUE/MAIN -> LANDED  accel magnitude within landed_accel of 1 g and, with a barometer,
+//                          velocity under landed_speed
+//
+// Without a barometer the estimate is accelerometer-only. That holds well enough to apogee, but a
+// steady descent also reads 1 g, so DROGUE -> MAIN never fires and LANDED needs landed_us * 4 of
+// stillness instead, which a long, smooth descent can still satisfy early.
+
+enum flight_phase {
+	PHASE_PAD = 0,
+	PHASE_BOOST,
+	PHASE_BURNOUT,
+	PHASE_COAST,
+	PHASE_APOGEE,
+	PHASE_DROGUE,
+	PHASE_MAIN,
+	PHASE_LANDED,
+	PHASE_COUNT
+};
+
+static inline const char* phase_name(int phase) {
+	static const char* names[PHASE_COUNT] = {"pad", "boost", "burnout", "coast", "apogee", "drogue", "main", "landed"};
+
+	return phase >= 0 && phase < PHASE_COUNT ? names[phase] : "?";
+}
+
+#define PHASE_G 9.80665
+
+struct phase_config {
+	int axis; // Accelerometer axis along the airframe, 0-2 for x-z.
+	float axis_sign; // 1 if that axis points at the nose, -1 if at the motor.
+	float launch_accel; // g
+	float launch_speed; // m/s
+	float burnout_accel; // g, axial.
+	float drogue_speed; // m/s, descending.
+	float main_speed; // m/s, descending.
+	float landed_speed; // m/s
+	float landed_accel; // g, from 1 g.
+	float mach_lockout; // m/s
+	float baro_bandwidth; // rad/s, of the barometer correction.
+	float ground_tau; // s, pad ground level average.
+	uint64_t launch_us; // Hold times.
+	uint64_t burnout_hold_us;
+	uint64_t burnout_us;
+	uint64_t apogee_hold_us;
+	uint64_t apogee_us;
+	uint64_t drogue_us;
+	uint64_t main_us;
+	uint64_t landed_us;
+};
+
+static inline phase_config default_phase_config() {
+	phase_config c;
+
+	c.axis = 2;
+	c.axis_sign = 1;
+	c.launch_accel = 3;
+	c.launch_speed = 25;
+	c.burnout_accel = 0;
+	c.drogue_speed = 10;
+	c.main_speed = 15;
+	c.landed_speed = 2;
+	c.landed_accel = 0.1;
+	c.mach_lockout = 250;
+	c.baro_bandwidth = 2;
+	c.ground_tau = 10;
+	c.launch_us = 50000;
+	c.burnout_hold_us = 100000;
+	c.burnout_us = 1000000;
+	c.apogee_hold_us = 100000;
+	c.apogee_us = 3000000;
+	c.drogue_us = 250000;
+	c.main_us = 1000000;
+	c.landed_us = 5000000;
+
+	return c;
+}
+
+class phase_detector {
+public:
+	phase_detector(const phase_config& config) : cfg(config), current(PHASE_PAD), last(0), have_ground(false), ground(0), alt(0), vel(0),
+		max_alt(0) {
+		for(int i = 0; i < PHASE_COUNT; i++)
+			entered[i] = 0;
+
+		pending[0] = pending[1] = false;
+		since[0] = since[1] = 0;
+	}
+
+	// One mpu_main sample: timestamp, accelerometer in g and, if valid, the barometric altitude (m,
+	// any datum). Returns the phase after it.
+	flight_phase update(uint64_t t, const float* accel, bool baro_valid, float baro_alt) {
+		float mag = sqrtf(accel[0] * accel[0] + accel[1] * accel[1] + accel[2] * accel[2]);
+		float axial = cfg.axis_sign * accel[cfg.axis];
+		float dt = last && t > last ? (t - last) / 1e6f : 0;
+
+		last = t;
+		dt = dt > 0.1f ? 0.1f : dt; // Replay gaps and the first sample.
+
+		if(!baro_valid || !std::isfinite(baro_alt))
+			baro_valid = false;
+		else if(!have_ground) {
+			ground = baro_alt;
+			have_ground = true;
+		} else if(current == PHASE_PAD && dt > 0)
+			ground += (baro_alt - ground) * (dt / (cfg.ground_tau + dt));
+
+		estimate(dt, mag, axial, baro_valid, baro_alt - ground);
+		advance(t, mag, axial, baro_valid);
+
+		return current;
+	}
+
+	flight_phase phase() const { return current; }
+	float altitude() const { return alt; } // m above the pad.
+	float velocity() const { return vel; } // m/s, up.
+	float apogee() const { return max_alt; }
+
+	// Timestamp the phase was entered, 0 if it hasn't been.
+	uint64_t entered_at(int phase) const { return entered[phase]; }
+
+private:
+	void estimate(float dt, float mag, float axial, bool baro_valid, float baro_agl) {
+		float a;
+
+		if(current == PHASE_PAD || current == PHASE_LANDED)
+			a = 0;
+		else if(current < PHASE_APOGEE)
+			a = (axial - 1) * PHASE_G;
+		else
+			a = (mag - 1) * PHASE_G;
+
+		alt += vel * dt + 0.5f * a * dt * dt;
+		vel += a * dt;
+
+		if(baro_valid && fabsf(vel) < cfg.mach_lockout) {
+			float w = cfg.baro_bandwidth;
+			float err = baro_agl - alt;
+
+			alt += 2 * w * dt * err;
+			vel += w * w * dt * err;
+		}
+
+		if(current == PHASE_LANDED)
+			vel = 0;
+
+		if(current != PHASE_PAD && alt > max_alt)
+			max_alt = alt;
+	}
+
+	void advance(uint64_t t, float mag, float axial, bool baro_valid) {
+		uint64_t in = t - entered[current];
+
+		switch(current) {
+		case PHASE_PAD:
+			if(held(0, t, mag > cfg.launch_accel, cfg.launch_us) || held(1, t, baro_valid && vel > cfg.launch_speed, cfg.launch_us))
+				enter(PHASE_BOOST, t);
+			break;
+		case PHASE_BOOST:
+			if(held(0, t, axial < cfg.burnout_accel, cfg.burnout_hold_us))
+				enter(PHASE_BURNOUT, t);
+			break;
+		case PHASE_BURNOUT:
+			if(in >= cfg.burnout_us)
+				enter(PHASE_COAST, t);
+			break;
+		case PHASE_COAST:
+			if(held(0, t, vel <= 0, cfg.apogee_hold_us))
+				enter(PHASE_APOGEE, t);
+			break;
+		case PHASE_APOGEE:
+			if(held(0, t, baro_valid && vel < -cfg.drogue_speed, cfg.drogue_us) || in >= cfg.apogee_us)
+				enter(PHASE_DROGUE, t);
+			break;
+		case PHASE_DROGUE:
+		case PHASE_MAIN:
+			if(held(0, t, still(mag, baro_valid), baro_valid ? cfg.landed_us : cfg.landed_us * 4))
+				enter(PHASE_LANDED, t);
+			else if(current == PHASE_DROGUE && held(1, t, baro_valid && vel < 0 && vel > -cfg.main_speed, cfg.main_us))
+				enter(PHASE_MAIN, t);
+			break;
+		default:
+			break;
+		}
+	}
+
+	bool still(float mag, bool baro_valid) const {
+		return fabsf(mag - 1) < cfg.landed_accel && (!baro_valid || fabsf(vel) < cfg.landed_speed);
+	}
+
+	// True once cond has held for hold_us without a break. Two timers, for phases with two ways out.
+	bool held(int i, uint64_t t, bool cond, uint64_t hold_us) {
+		if(!cond) {
+			pending[i] = false;
+			return false;
+		}
+
+		if(!pending[i]) {
+			pending[i] = true;
+			since[i] = t;
+		}
+
+		return t - since[i] >= hold_us;
+	}
+
+	void enter(flight_phase phase, uint64_t t) {
+		current = phase;
+		entered[phase] = t;
+		pending[0] = pending[1] = false;
+	}
+
+	phase_config cfg;
+	flight_phase current;
+	uint64_t last;
+	uint64_t entered[PHASE_COUNT];
+
+	bool have_ground;
+	float ground;
+	float alt, vel;
+	float max_alt;
+
+	bool pending[2];
+	uint64_t since[2];
+};
+
+#endif //FLIGHT_PHASE_H
@@ -0,0 +1,518 @@
+#ifndef FLIGHTLOG_H
+#define FLIGHTLOG_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "bitstream.h"
+#include "telemetry.h"
+#include "spsc.h"
+#include "realtime.h"
+
+// Columnar telemetry flight log.
+//
+// Every telemetry sample (timestamp + the fields of tlm_schema) is logged, not just the ones that
+// make it onto the radio. Samples are stored in chunks of up to FLOG_CHUNK_SAMPLES, one column
+// per field, behind a chunk header that carries the chunk's time range and each column's
+// min/max. A reader can therefore find a time, or the chunk holding apogee, from the headers alone
+// and then touch only the column it needs.
+//
+// File:  flog_file_header, then chunks back to back. There is no index or footer to write at the
+//        end, so a log cut off by power loss is readable up to its last complete chunk.
+// Chunk: flog_chunk_header, then the columns, each starting 8-byte aligned. Column 0 is time.
+//
+// A column is FLOG_RAW (a plain little-endian array: uint64_t for time, int32_t for fields, mapped
+// straight out of the file) or, with compression on, FLOG_DELTA when that is smaller: the first
+// value in base, then the zigzagged differences bit-packed at a fixed width. A column that never
+// changes in the chunk (FPS, volts on the pad) costs no bytes at all.
+//
+// As with the black box, the flight thread only pushes samples into an SPSC queue; encoding and
+// file I/O happen on the log's own low-priority thread.
+
+#define FLOG_MAGIC "TECSFLOG"
+#define FLOG_CHUNK_MAGIC 0x4b484346 // "FCHK", little-endian on disk.
+#define FLOG_VERSION 1
+#define FLOG_CHUNK_SAMPLES 4096
+#define FLOG_FLUSH_MS 5000 // Write out a partial chunk after this long.
+#define FLOG_QUEUE_SIZE 2048
+#define FLOG_COLUMNS (TLM_FIELD_COUNT + 1) // Time, then the telemetry fields in schema order.
+#define FLOG_TIME 0
+
+// flog_column.encoding
+#define FLOG_RAW 0
+#define FLOG_DELTA 1
+
+// flog_chunk_header.flags
+#define FLOG_COMPRESSED 0x01 // At least one column is FLOG_DELTA.
+
+struct flog_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t fields; // TLM_FIELD_COUNT when written.
+	uint8_t field_bits[32];
+	uint8_t field_signed[32];
+	uint32_t chunk_samples;
+	uint32_t reserved;
+	uint64_t created; // Unix time, s.
+};
+
+static_assert(sizeof(flog_file_header) == 96, "flog_file_header must stay 96 bytes");
+
+struct flog_column {
+	uint32_t offset; // From the start of the chunk header.
+	uint32_t bytes;
+	uint8_t encoding;
+	uint8_t bits; // FLOG_DELTA width.
+	uint16_t reserved;
+	int32_t min; // Fields only.
+	int32_t max;
+	int64_t base; // First value.
+};
+
+struct flog_chunk_header {
+	uint32_t magic;
+	uint32_t size; // Whole chunk including this header, a multiple of 8.
+	uint32_t seq;
+	uint32_t count;
+	uint64_t t_first; // us
+	uint64_t t_last;
+	uint32_t flags;
+	uint32_t crc; // CRC-32 of everything after the header.
+	flog_column columns[FLOG_COLUMNS];
+};
+
+static_assert(sizeof(flog_column) == 32, "flog_column must stay 32 bytes");
+
+struct flog_sample {
+	uint64_t timestamp;
+	int32_t values[TLM_FIELD_COUNT];
+};
+
+static inline size_t flog_align(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// Worst case encoded chunk: every column raw.
+#define FLOG_MAX_CHUNK (flog_align(sizeof(flog_chunk_header)) + flog_align(8 * FLOG_CHUNK_SAMPLES) + TLM_FIELD_COUNT * flog_align(4 * FLOG_CHUNK_SAMPLES))
+
+class flightlog_writer {
+public:
+	flightlog_writer() : fd(-1), chunk(NULL), used(0), seq(0), compress(false), running(false), samples(0), chunks(0), bytes(0), dropped(0), write_errors(0) {}
+
+	bool open(const std::string& file, bool use_compression) {
+		compress = use_compression;
+
+		chunk = (uint8_t*)malloc(FLOG_MAX_CHUNK);
+		if(chunk == NULL)
+			return false;
+
+		fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			return false;
+
+		flog_file_header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, FLOG_MAGIC, sizeof(h.magic));
+		h.version = FLOG_VERSION;
+		h.fields = TLM_FIELD_COUNT;
+		h.chunk_samples = FLOG_CHUNK_SAMPLES;
+		h.created = time(NULL);
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++) {
+			h.field_bits[f] = tlm_schema::field_bits(f);
+			h.field_signed[f] = tlm_schema::field_signed(f);
+		}
+
+		return write(fd, &h, sizeof(h)) == sizeof(h);
+	}
+
+	// Producer side, one thread. Never blocks; returns false and counts a drop when full.
+	bool log(uint64_t timestamp, const int64_t* values) {
+		flog_sample s;
+
+		s.timestamp = timestamp;
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+			s.values[f] = (int32_t)values[f];
+
+		if(queue.push(s))
+			return true;
+
+		dropped++;
+		return false;
+	}
+
+	void start() {
+		running = true;
+		writer = std::thread(&flightlog_writer::run, this);
+	}
+
+	// Drains the queue, writes the last partial chunk, syncs and closes.
+	void stop() {
+		running = false;
+
+		if(writer.joinable())
+			writer.join();
+
+		if(fd >= 0) {
+			fdatasync(fd);
+			close(fd);
+			fd = -1;
+		}
+
+		free(chunk);
+		chunk = NULL;
+	}
+
+	uint64_t samples_written() const { return samples; }
+	uint64_t chunks_written() const { return chunks; }
+	uint64_t bytes_written() const { return bytes; }
+	uint64_t samples_dropped() const { return dropped; }
+	uint64_t errors() const { return write_errors; }
+
+private:
+	void run() {
+		rt_thread("flightlog", 0, RT_CPU_BACKGROUND);
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+
+		std::chrono::steady_clock::time_point last_flush = std::chrono::steady_clock::now();
+
+		while(true) {
+			bool stopping = !running;
+			size_t drained = 0;
+			flog_sample s;
+
+			while(queue.pop(s)) {
+				times[used] = s.timestamp;
+				for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+					columns[f][used] = s.values[f];
+
+				drained++;
+
+				if(++used == FLOG_CHUNK_SAMPLES) {
+					write_chunk();
+					last_flush = std::chrono::steady_clock::now();
+				}
+			}
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			if(used > 0 && (stopping || now - last_flush > std::chrono::milliseconds(FLOG_FLUSH_MS))) {
+				write_chunk();
+				last_flush = now;
+			}
+
+			if(stopping)
+				break;
+
+			if(drained == 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	// Appends one column at pos and fills in its descriptor. Returns the new position.
+	size_t put_column(size_t pos, flog_column& c, const int64_t* v, size_t width) {
+		int64_t lo = v[0], hi = v[0];
+		uint64_t zmax = 0;
+
+		for(size_t i = 1; i < used; i++) {
+			int64_t d = v[i] - v[i - 1];
+			uint64_t z = (uint64_t)d << 1 ^ (uint64_t)(d >> 63);
+
+			zmax |= z;
+			lo = v[i] < lo ? v[i] : lo;
+			hi = v[i] > hi ? v[i] : hi;
+		}
+
+		size_t bits = 64 - (zmax ? __builtin_clzll(zmax) : 64);
+		size_t packed = (bits * (used - 1) + 7) / 8;
+
+		c.offset = pos;
+		c.min = (int32_t)lo;
+		c.max = (int32_t)hi;
+		c.base = v[0];
+		c.reserved = 0;
+
+		if(compress && packed < width * used) {
+			bit_writer bw(scratch);
+
+			for(size_t i = 1; i < used && bits; i++) {
+				int64_t d = v[i] - v[i - 1];
+				bw.put((uint64_t)d << 1 ^ (uint64_t)(d >> 63), bits);
+			}
+
+			c.encoding = FLOG_DELTA;
+			c.bits = bits;
+			c.bytes = bits ? bw.finish() : 0;
+			memcpy(chunk + pos, scratch, c.bytes);
+		} else {
+			c.encoding = FLOG_RAW;
+			c.bits = 0;
+			c.bytes = width * used;
+
+			for(size_t i = 0; i < used; i++) {
+				if(width == 8) {
+					uint64_t x = v[i];
+					memcpy(chunk + pos + 8 * i, &x, 8);
+				} else {
+					int32_t x = (int32_t)v[i];
+					memcpy(chunk + pos + 4 * i, &x, 4);
+				}
+			}
+		}
+
+		size_t end = flog_align(pos + c.bytes);
+		memset(chunk + pos + c.bytes, 0, end - pos - c.bytes);
+		return end;
+	}
+
+	void write_chunk() {
+		flog_chunk_header h;
+		memset(&h, 0, sizeof(h));
+
+		int64_t v[FLOG_CHUNK_SAMPLES];
+		size_t pos = flog_align(sizeof(h));
+
+		for(size_t i = 0; i < used; i++)
+			v[i] = (int64_t)times[i];
+		pos = put_column(pos, h.columns[FLOG_TIME], v, 8);
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++) {
+			for(size_t i = 0; i < used; i++)
+				v[i] = columns[f][i];
+			pos = put_column(pos, h.columns[f + 1], v, 4);
+		}
+
+		for(size_t c = 0; c < FLOG_COLUMNS; c++)
+			if(h.columns[c].encoding == FLOG_DELTA)
+				h.flags |= FLOG_COMPRESSED;
+
+		h.magic = FLOG_CHUNK_MAGIC;
+		h.size = pos;
+		h.seq = seq++;
+		h.count = used;
+		h.t_first = times[0];
+		h.t_last = times[used - 1];
+		h.crc = crc32(chunk + sizeof(h), pos - sizeof(h));
+		memcpy(chunk, &h, sizeof(h));
+
+		if(fd >= 0 && write(fd, chunk, pos) == (ssize_t)pos) {
+			samples += used;
+			chunks++;
+			bytes += pos;
+			fdatasync(fd);
+		} else
+			write_errors++;
+
+		used = 0;
+	}
+
+	spsc_queue<flog_sample, FLOG_QUEUE_SIZE> queue;
+
+	int fd;
+	uint8_t* chunk;
+	size_t used;
+	uint32_t seq;
+	bool compress;
+
+	uint64_t times[FLOG_CHUNK_SAMPLES];
+	int32_t columns[TLM_FIELD_COUNT][FLOG_CHUNK_SAMPLES];
+	uint8_t scratch[8 * FLOG_CHUNK_SAMPLES + 8];
+
+	std::atomic<bool> running;
+	std::thread writer;
+
+	std::atomic<uint64_t> samples;
+	std::atomic<uint64_t> chunks;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> write_errors;
+};
+
+// Read side. Maps the whole log and indexes it by walking the chunk headers; no column is
+// decoded until asked for, and FLOG_RAW columns are handed out as pointers into the mapping.
+class flightlog_reader {
+public:
+	flightlog_reader() : data(NULL), len(0) {}
+	~flightlog_reader() { close(); }
+
+	bool open(const std::string& file) {
+		int fd = ::open(file.c_str(), O_RDONLY);
+		struct stat st;
+
+		if(fd < 0)
+			return false;
+
+		if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(flog_file_header)) {
+			::close(fd);
+			return false;
+		}
+
+		len = st.st_size;
+		data = (const uint8_t*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+
+		if(data == MAP_FAILED) {
+			data = NULL;
+			return false;
+		}
+
+		memcpy(&header, data, sizeof(header));
+
+		if(memcmp(header.magic, FLOG_MAGIC, sizeof(header.magic)) != 0 || header.version != FLOG_VERSION || header.fields != TLM_FIELD_COUNT) {
+			close();
+			return false;
+		}
+
+		// Stop at the first chunk that isn't whole, or whose header doesn't describe its own
+		// contents: that's where the recording was cut off or damaged. Everything after open() reads
+		// columns straight from these headers, so they're checked here once.
+		for(size_t pos = sizeof(flog_file_header); pos + sizeof(flog_chunk_header) <= len;) {
+			const flog_chunk_header* h = (const flog_chunk_header*)(data + pos);
+
+			if(h->magic != FLOG_CHUNK_MAGIC || h->size < sizeof(flog_chunk_header) || h->size > len - pos || !valid(h))
+				break;
+
+			index.push_back(h);
+			pos += h->size;
+		}
+
+		return true;
+	}
+
+	void close() {
+		if(data)
+			munmap((void*)data, len);
+
+		data = NULL;
+		len = 0;
+		index.clear();
+	}
+
+	const flog_file_header& file_header() const { return header; }
+	size_t chunks() const { return index.size(); }
+	const flog_chunk_header& chunk(size_t i) const { return *index[i]; }
+
+	// Chunk holding time t (or the first one after it), chunks() if t is past the end.
+	size_t find_time(uint64_t t) const {
+		size_t lo = 0, hi = index.size();
+
+		while(lo < hi) {
+			size_t mid = (lo + hi) / 2;
+
+			if(index[mid]->t_last < t)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return lo;
+	}
+
+	// Chunk with the largest value of a field, from the headers alone (apogee: TLM_ALT).
+	size_t find_max(size_t field) const {
+		size_t best = 0;
+
+		for(size_t i = 1; i < index.size(); i++)
+			if(index[i]->columns[field + 1].max > index[best]->columns[field + 1].max)
+				best = i;
+
+		return best;
+	}
+
+	bool verify(size_t i) const {
+		const flog_chunk_header* h = index[i];
+		return crc32((const uint8_t*)h + sizeof(*h), h->size - sizeof(*h)) == h->crc;
+	}
+
+	// Timestamps of chunk i. Points into the mapping when the column is raw, otherwise decodes into
+	// scratch (FLOG_CHUNK_SAMPLES entries).
+	const uint64_t* times(size_t i, uint64_t* scratch) const {
+		const flog_chunk_header* h = index[i];
+		const flog_column& c = h->columns[FLOG_TIME];
+
+		if(c.encoding == FLOG_RAW)
+			return (const uint64_t*)((const uint8_t*)h + c.offset);
+
+		decode(h, c, scratch);
+		return scratch;
+	}
+
+	// Values of one field in chunk i, same rules as times().
+	const int32_t* column(size_t i, size_t field, int32_t* scratch) const {
+		const flog_chunk_header* h = index[i];
+		const flog_column& c = h->columns[field + 1];
+
+		if(c.encoding == FLOG_RAW)
+			return (const int32_t*)((const uint8_t*)h + c.offset);
+
+		decode(h, c, scratch);
+		return scratch;
+	}
+
+private:
+	// Sample count within FLOG_CHUNK_SAMPLES (the readers' scratch size), and every column inside
+	// the chunk, aligned, and big enough for count values in its encoding.
+	static bool valid(const flog_chunk_header* h) {
+		if(h->count == 0 || h->count > FLOG_CHUNK_SAMPLES)
+			return false;
+
+		for(size_t i = 0; i < FLOG_COLUMNS; i++) {
+			const flog_column& c = h->columns[i];
+			uint64_t need;
+
+			if(c.encoding == FLOG_RAW)
+				need = (uint64_t)h->count * (i == FLOG_TIME ? 8 : 4);
+			else if(c.encoding == FLOG_DELTA && c.bits <= 64)
+				need = ((uint64_t)c.bits * (h->count - 1) + 7) / 8;
+			else
+				return false;
+
+			if(need == 0)
+				continue;
+
+			if(c.offset < sizeof(flog_chunk_header) || c.offset % 8 != 0 || c.bytes < need || (uint64_t)c.offset + c.bytes > h->size)
+				return false;
+		}
+
+		return true;
+	}
+
+	template<typename T>
+	static void decode(const flog_chunk_header* h, const flog_column& c, T* out) {
+		bit_reader br((const uint8_t*)h + c.offset, c.bytes);
+		int64_t v = c.base;
+
+		out[0] = (T)v;
+
+		for(size_t i = 1; i < h->count; i++) {
+			if(c.bits) {
+				uint64_t z = br.get(c.bits);
+				v += (int64_t)((z >> 1) ^ (0 - (z & 1)));
+			}
+
+			out[i] = (T)v;
+		}
+	}
+
+	const uint8_t* data;
+	size_t len;
+	flog_file_header header;
+	std::vector<const flog_chunk_header*> index;
+};
+
+#endif //FLIGHTLOG_H
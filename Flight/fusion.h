@@ -0,0 +1,252 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include "recorder.h"
+
+// Dual-IMU fusion with redundancy voting.
+//
+// Takes the newest mpu_main and mpu_aux samples at each update and merges them into one estimate;
+// either may be missing, so the loop keeps running on mpu_aux if mpu_main stops answering. Per
+// axis, every usable reading is combined with inverse-variance weights. A reading is unusable
+// when its sensor has failed or that axis is pinned at the sensor's range (boost will saturate the
+// lower-range part first). When every sensor is saturated on an axis, the reading from the
+// widest-range sensor wins, since it's the closest thing to the truth we have.
+//
+// A sensor is voted bad for a sample when its data is invalid, stale, non-finite, or when the two
+// IMUs disagree and it is the one to blame: the failed one if only one has failed, otherwise the
+// one further from the previous fused estimate. fail_count bad samples in a row fail it over.
+// Coming back takes recover_count good samples in a row that also agree with the healthy IMU, so a
+// failed sensor that is stuck on sane-looking values stays out. A sample that can't be compared
+// (either IMU missing or saturated) doesn't count either way; with no healthy IMU to check
+// against, sanity alone counts.
+
+#define FUSION_IMUS 2 // Index 0 is mpu_main, 1 is mpu_aux.
+
+// imu_fusion::status() bits.
+#define FUSION_MAIN_FAILED 0x01
+#define FUSION_AUX_FAILED 0x02
+#define FUSION_SATURATED 0x04 // At least one axis had every sensor saturated.
+#define FUSION_HOLDING 0x08 // No usable sensor; holding the last estimate.
+
+struct fusion_config {
+	float accel_range[FUSION_IMUS]; // g, full scale as configured in RTIMULib.ini (payload reads it).
+	float gyro_range[FUSION_IMUS]; // deg/s, full scale.
+	float accel_noise[FUSION_IMUS]; // g, 1-sigma.
+	float gyro_noise[FUSION_IMUS]; // deg/s, 1-sigma.
+	float saturation; // Fraction of full scale treated as pinned.
+	float max_accel_disagree; // g, vector difference before voting.
+	float max_gyro_disagree; // deg/s, vector difference before voting.
+	uint64_t stale_us; // A sample further than this from the update time counts as missing.
+	int fail_count;
+	int recover_count;
+};
+
+static inline fusion_config default_fusion_config() {
+	fusion_config c;
+
+	for(int i = 0; i < FUSION_IMUS; i++) {
+		c.accel_range[i] = 16;
+		c.gyro_range[i] = 2000;
+		c.accel_noise[i] = 0.01;
+		c.gyro_noise[i] = 0.1;
+	}
+
+	c.saturation = 0.98;
+	c.max_accel_disagree = 2;
+	c.max_gyro_disagree = 50;
+	c.stale_us = 20000;
+	c.fail_count = 10;
+	c.recover_count = 100;
+
+	return c;
+}
+
+class imu_fusion {
+public:
+	imu_fusion(const fusion_config& config) : cfg(config), have_estimate(false), flags(0) {
+		memset(&estimate, 0, sizeof(estimate));
+
+		for(int i = 0; i < FUSION_IMUS; i++) {
+			failed[i] = false;
+			bad_run[i] = 0;
+			good_run[i] = 0;
+		}
+	}
+
+	// Fuses the main and aux samples nearest to now; either may be NULL, which votes against it.
+	const bb_record& update(const bb_record* main, const bb_record* aux, uint64_t now) {
+		const bb_record* in[FUSION_IMUS] = {main, aux};
+		bool ok[FUSION_IMUS];
+
+		for(int i = 0; i < FUSION_IMUS; i++)
+			ok[i] = in[i] != NULL && sane(*in[i]) && delta(in[i]->timestamp, now) <= cfg.stale_us;
+
+		bool agreed = false;
+
+		if(ok[0] && ok[1] && comparable(*in[0], *in[1])) {
+			if(!disagree(*in[0], *in[1]))
+				agreed = true;
+			else if(failed[0] != failed[1])
+				ok[failed[0] ? 0 : 1] = false;
+			else if(have_estimate)
+				ok[distance(*in[0]) > distance(*in[1]) ? 0 : 1] = false;
+		}
+
+		for(int i = 0; i < FUSION_IMUS; i++) {
+			// A failed sensor's good sample only counts once it has been checked against a healthy one.
+			if(failed[i] && ok[i] && !failed[1 - i] && !agreed)
+				continue;
+
+			vote(i, ok[i]);
+		}
+
+		bb_record out = estimate;
+		out.timestamp = now;
+		out.source = BB_MPU_MAIN;
+		flags = (failed[0] ? FUSION_MAIN_FAILED : 0) | (failed[1] ? FUSION_AUX_FAILED : 0);
+
+		bool any = false;
+		for(int a = 0; a < 3; a++) {
+			any |= fuse_axis(in, ok, a, &bb_record::accel, cfg.accel_range, cfg.accel_noise, out.accel[a]);
+			any |= fuse_axis(in, ok, a, &bb_record::gyro, cfg.gyro_range, cfg.gyro_noise, out.gyro[a]);
+		}
+
+		int pose_from = usable(0, ok) ? 0 : (usable(1, ok) ? 1 : -1);
+		if(pose_from >= 0) {
+			// RTIMULib already fuses attitude per IMU; average when both are usable, minding the +/-180 wrap.
+			for(int a = 0; a < 3; a++)
+				out.pose[a] = usable(0, ok) && usable(1, ok) ? mean_angle(in[0]->pose[a], in[1]->pose[a]) : in[pose_from]->pose[a];
+			memcpy(out.compass, in[pose_from]->compass, sizeof(out.compass));
+		}
+
+		if(!any)
+			flags |= FUSION_HOLDING;
+
+		out.valid = any ? (BB_VALID_ACCEL | BB_VALID_GYRO | (pose_from >= 0 ? BB_VALID_POSE | BB_VALID_COMPASS : 0)) : 0;
+
+		estimate = out;
+		have_estimate = have_estimate || any;
+		return estimate;
+	}
+
+	bool imu_failed(int i) const { return failed[i]; }
+	uint8_t status() const { return flags; }
+	uint64_t stale_us() const { return cfg.stale_us; }
+
+private:
+	typedef float (bb_record::*axis_field)[3];
+
+	static uint64_t delta(uint64_t a, uint64_t b) { return a > b ? a - b : b - a; }
+
+	static bool sane(const bb_record& r) {
+		if((r.valid & (BB_VALID_ACCEL | BB_VALID_GYRO)) != (BB_VALID_ACCEL | BB_VALID_GYRO))
+			return false;
+
+		for(int a = 0; a < 3; a++)
+			if(!std::isfinite(r.accel[a]) || !std::isfinite(r.gyro[a]))
+				return false;
+
+		return true;
+	}
+
+	static float norm3(const float* a, const float* b) {
+		float x = a[0] - b[0], y = a[1] - b[1], z = a[2] - b[2];
+		return std::sqrt(x * x + y * y + z * z);
+	}
+
+	static float mean_angle(float a, float b) {
+		float d = b - a;
+
+		if(d > 180)
+			d -= 360;
+		else if(d < -180)
+			d += 360;
+
+		float m = a + d / 2;
+		return m > 180 ? m - 360 : (m < -180 ? m + 360 : m);
+	}
+
+	bool saturated(int i, const bb_record& r) const {
+		for(int a = 0; a < 3; a++)
+			if(std::fabs(r.accel[a]) >= cfg.saturation * cfg.accel_range[i] || std::fabs(r.gyro[a]) >= cfg.saturation * cfg.gyro_range[i])
+				return true;
+		return false;
+	}
+
+	// Only compare sensors when neither is clipping; a saturated axis will disagree by design.
+	bool comparable(const bb_record& a, const bb_record& b) const {
+		return !saturated(0, a) && !saturated(1, b);
+	}
+
+	bool disagree(const bb_record& a, const bb_record& b) const {
+		return norm3(a.accel, b.accel) > cfg.max_accel_disagree || norm3(a.gyro, b.gyro) > cfg.max_gyro_disagree;
+	}
+
+	float distance(const bb_record& r) const {
+		return norm3(r.accel, estimate.accel) / cfg.max_accel_disagree + norm3(r.gyro, estimate.gyro) / cfg.max_gyro_disagree;
+	}
+
+	void vote(int i, bool good) {
+		if(good) {
+			bad_run[i] = 0;
+			if(failed[i] && ++good_run[i] >= cfg.recover_count)
+				failed[i] = false;
+		} else {
+			good_run[i] = 0;
+			if(!failed[i] && ++bad_run[i] >= cfg.fail_count)
+				failed[i] = true;
+		}
+	}
+
+	bool usable(int i, const bool* ok) const { return ok[i] && !failed[i]; }
+
+	bool fuse_axis(const bb_record* const* in, const bool* ok, int a, axis_field field, const float* range, const float* noise, float& out) {
+		float sum = 0, weight = 0;
+		int widest = -1;
+
+		for(int i = 0; i < FUSION_IMUS; i++) {
+			if(!usable(i, ok))
+				continue;
+
+			float v = (in[i]->*field)[a];
+
+			if(widest < 0 || range[i] > range[widest])
+				widest = i;
+
+			if(std::fabs(v) >= cfg.saturation * range[i])
+				continue;
+
+			float w = 1 / (noise[i] * noise[i]);
+			sum += w * v;
+			weight += w;
+		}
+
+		if(weight > 0) {
+			out = sum / weight;
+			return true;
+		}
+
+		if(widest >= 0) {
+			out = (in[widest]->*field)[a];
+			flags |= FUSION_SATURATED;
+			return true;
+		}
+
+		return false;
+	}
+
+	fusion_config cfg;
+	bb_record estimate;
+	bool have_estimate;
+	uint8_t flags;
+
+	bool failed[FUSION_IMUS];
+	int bad_run[FUSION_IMUS];
+	int good_run[FUSION_IMUS];
+};
+
+#endif //FUSION_H
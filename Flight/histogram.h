@@ -0,0 +1,87 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+
+// Fixed-bucket histogram of signed microsecond latencies (lateness against a deadline).
+class latency_histogram {
+public:
+	static const int buckets = 64; // The last bucket collects everything >= buckets * bucket_us.
+
+	latency_histogram(int bucket_width_us = 10) : bucket_us(bucket_width_us) { reset(); }
+
+	void reset() {
+		count = 0;
+		sum = 0;
+		sum_sq = 0;
+		min_us = INT64_MAX;
+		max_us = INT64_MIN;
+
+		for(int i = 0; i < buckets; i++)
+			bins[i] = 0;
+	}
+
+	void add(int64_t us) {
+		int64_t bin = us <= 0 ? 0 : us / bucket_us;
+		if(bin >= buckets)
+			bin = buckets - 1;
+
+		bins[bin]++;
+		count++;
+		sum += us;
+		sum_sq += (double)us * us;
+
+		if(us < min_us)
+			min_us = us;
+		if(us > max_us)
+			max_us = us;
+	}
+
+	// Smallest bucket bound that covers fraction p (0 - 1) of the samples.
+	int64_t percentile(double p) const {
+		uint64_t target = (uint64_t)std::ceil(p * count);
+		uint64_t seen = 0;
+
+		for(int i = 0; i < buckets; i++) {
+			seen += bins[i];
+			if(seen >= target && seen > 0)
+				return i == buckets - 1 ? max_us : (int64_t)(i + 1) * bucket_us;
+		}
+
+		return max_us;
+	}
+
+	void print(const char* name) const {
+		if(count == 0) {
+			printf("%s: no samples\n", name);
+			return;
+		}
+
+		double mean = (double)sum / count;
+		double stddev = std::sqrt(sum_sq / count - mean * mean);
+
+		printf("%s: n=%llu min=%lld mean=%.1f sd=%.1f p99<=%lld p99.9<=%lld max=%lld us\n", name, (unsigned long long)count,
+			(long long)min_us, mean, stddev, (long long)percentile(0.99), (long long)percentile(0.999), (long long)max_us);
+
+		for(int i = 0; i < buckets; i++)
+			if(bins[i])
+				printf("  %s%4d us: %llu\n", i == buckets - 1 ? ">=" : "< ", (i + (i == buckets - 1 ? 0 : 1)) * bucket_us,
+					(unsigned long long)bins[i]);
+	}
+
+	uint64_t samples() const { return count; }
+	int64_t worst() const { return max_us; }
+
+private:
+	int bucket_us;
+	uint64_t bins[buckets];
+	uint64_t count;
+	int64_t sum;
+	double sum_sq;
+	int64_t min_us;
+	int64_t max_us;
+};
+
+#endif //HISTOGRAM_H
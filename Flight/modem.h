@@ -0,0 +1,195 @@
+#ifndef MODEM_H
+#define MODEM_H
+
+#include <cstddef>
+#include <cstdint>
+
+// LoRa modem profiles and the selection logic for adaptive mode (radio --adaptive).
+//
+// Profiles are ranked fastest to most robust. The selector picks the fastest profile that both
+// the current altitude and the latest link report from the ground allow, with hysteresis on both
+// and a minimum dwell between switches so a marginal link doesn't flap. It only decides; the
+// handover itself is done by radio.cpp.
+//
+// Nothing moves off MODEM_DEFAULT_PROFILE until the first link report arrives: a ground station
+// that never transmits (Ground/irec2018_gr.py is receive-only, fixed at the default profile) can't
+// follow a switch, and its silence is indistinguishable from a link that was never up.
+//
+// Handover: the flight side sends MODEM_ANNOUNCE_COUNT switch packets on the old profile, each
+// carrying the target profile and how many announcements are left, then retunes after the last
+// one has left the antenna. The ground station retunes when it hears countdown 0, or when it has
+// heard any announcement and then nothing for MODEM_ANNOUNCE_TIMEOUT_US. If the ground's link
+// reports stop for MODEM_REPORT_TIMEOUT_US, both ends go back to MODEM_DEFAULT_PROFILE, the
+// rendezvous. The current profile is also beaconed every MODEM_BEACON_US so a ground station that
+// missed a switch and is hunting through the table locks back on quickly.
+//
+// Control packets are 5 bytes and go out as their own radio packets, never mixed with frames:
+//     downlink switch:  MODEM_CTRL_START 'S' <target profile> <announcements left> MODEM_CTRL_END
+//     uplink report:    MODEM_CTRL_START 'L' <RSSI dBm, int8> <SNR in 0.25 dB, int8> MODEM_CTRL_END
+
+struct modem_profile {
+	const char* name;
+	uint8_t reg_1d; // RH_RF95 ModemConfig register values.
+	uint8_t reg_1e;
+	uint8_t reg_26;
+	float snr_floor; // dB. Demodulation limit for the spreading factor.
+};
+
+// Register values from the RadioHead RH_RF95 modem config table.
+static const modem_profile modem_profiles[] = {
+	{"Bw500Cr45Sf128",   0x92, 0x74, 0x04, -7.5},  // Pad and low altitude: max rate.
+	{"Bw125Cr45Sf128",   0x72, 0x74, 0x04, -7.5},  // RH/chip default.
+	{"Bw31_25Cr48Sf512", 0x48, 0x94, 0x04, -12.5},
+	{"Bw125Cr48Sf4096",  0x78, 0xc4, 0x0c, -20.0}, // Apogee: max range.
+};
+
+#define MODEM_PROFILE_COUNT (sizeof(modem_profiles) / sizeof(modem_profiles[0]))
+#define MODEM_DEFAULT_PROFILE 1 // What both ends fall back to when the link is lost.
+
+#define MODEM_SNR_MARGIN 6.0 // dB above the floor needed to step to a faster profile.
+#define MODEM_SNR_HYSTERESIS 3.0 // dB the margin may shrink before stepping back down.
+#define MODEM_ALT_HYSTERESIS 100 // m.
+#define MODEM_MIN_DWELL_US 5000000
+#define MODEM_REPORT_TIMEOUT_US 10000000 // No link report for this long: fall back to the default.
+#define MODEM_ANNOUNCE_COUNT 3
+#define MODEM_ANNOUNCE_TIMEOUT_US 2000000
+#define MODEM_BEACON_US 5000000
+
+#define MODEM_CTRL_START 0xa5
+#define MODEM_CTRL_END 0x5a
+#define MODEM_CTRL_LEN 5
+#define MODEM_CTRL_SWITCH 'S'
+#define MODEM_CTRL_REPORT 'L'
+
+// Altitude (m AGL) at which each profile stops being fast enough to be worth the risk.
+static const int modem_alt_limit[] = {300, 1200, 2500, 100000};
+
+class modem_selector {
+public:
+	modem_selector() : current(MODEM_DEFAULT_PROFILE), alt_rank(0), link_rank(0), last_report(0), last_switch(0) {}
+
+	// Latest TLM_ALT, m above the pad: from telemetry passing through radio, or from payload's
+	// phase detector when it predicts what radio will pick.
+	void altitude(int alt) {
+		// Step down (more robust) as soon as we cross a limit, back up only once clear by the hysteresis.
+		while(alt_rank < (int)MODEM_PROFILE_COUNT - 1 && alt > modem_alt_limit[alt_rank])
+			alt_rank++;
+		while(alt_rank > 0 && alt < modem_alt_limit[alt_rank - 1] - MODEM_ALT_HYSTERESIS)
+			alt_rank--;
+	}
+
+	// Link report from the ground: SNR of our downlink as received there.
+	void link_report(float snr, uint64_t now) {
+		last_report = now;
+
+		// Too close to the floor of the active profile: go more robust.
+		if(snr < modem_profiles[current].snr_floor + MODEM_SNR_MARGIN - MODEM_SNR_HYSTERESIS)
+			link_rank = current + 1 < (int)MODEM_PROFILE_COUNT ? current + 1 : current;
+		// Comfortably above the floor of the next faster profile: allow it.
+		else if(current > 0 && snr > modem_profiles[current - 1].snr_floor + MODEM_SNR_MARGIN)
+			link_rank = current - 1;
+		else
+			link_rank = current;
+	}
+
+	// Profile we should be on now. Only changes once per MODEM_MIN_DWELL_US.
+	int select(uint64_t now) {
+		int want = alt_rank > link_rank ? alt_rank : link_rank;
+
+		// No ground heard yet, or it went quiet: stay at (or go back to) the rendezvous profile.
+		if(last_report == 0 || now - last_report > MODEM_REPORT_TIMEOUT_US)
+			want = MODEM_DEFAULT_PROFILE;
+
+		if(want != current && now - last_switch >= MODEM_MIN_DWELL_US)
+			return want;
+
+		return current;
+	}
+
+	void switched(int profile, uint64_t now) {
+		current = profile;
+		last_switch = now;
+	}
+
+	int profile() const { return current; }
+	int altitude_rank() const { return alt_rank; } // The fastest profile the altitude allows.
+
+private:
+	int current;
+	int alt_rank;
+	int link_rank;
+	uint64_t last_report;
+	uint64_t last_switch;
+};
+
+static inline void modem_switch_packet(uint8_t* out, int target, int left) {
+	out[0] = MODEM_CTRL_START;
+	out[1] = MODEM_CTRL_SWITCH;
+	out[2] = target;
+	out[3] = left;
+	out[4] = MODEM_CTRL_END;
+}
+
+// Uplink report as the ground station sends it. SNR is clamped to what the int8 quarter-dB field holds.
+static inline void modem_report_packet(uint8_t* out, int rssi, float snr) {
+	int q = (int)(snr * 4);
+
+	out[0] = MODEM_CTRL_START;
+	out[1] = MODEM_CTRL_REPORT;
+	out[2] = (uint8_t)(int8_t)(rssi < -128 ? -128 : rssi > 127 ? 127 : rssi);
+	out[3] = (uint8_t)(int8_t)(q < -128 ? -128 : q > 127 ? 127 : q);
+	out[4] = MODEM_CTRL_END;
+}
+
+// Returns false if data isn't a link report.
+static inline bool modem_parse_report(const uint8_t* data, size_t len, int& rssi, float& snr) {
+	if(len != MODEM_CTRL_LEN || data[0] != MODEM_CTRL_START || data[1] != MODEM_CTRL_REPORT || data[4] != MODEM_CTRL_END)
+		return false;
+
+	rssi = (int8_t)data[2];
+	snr = (int8_t)data[3] / 4.0f;
+	return true;
+}
+
+// Decoded RF95 modem registers (0x1D, 0x1E, 0x26).
+struct modem_params {
+	unsigned sf; // Spreading factor, 6 - 12.
+	float bw; // Hz
+	unsigned cr; // Coding rate 4/(4 + cr), 1 - 4.
+	bool implicit_header;
+	bool crc;
+	bool low_rate_opt;
+};
+
+static inline modem_params modem_decode(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26) {
+	static const float bandwidths[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+	modem_params m;
+
+	m.bw = bandwidths[(reg_1d >> 4) < 10 ? reg_1d >> 4 : 7];
+	m.cr = (reg_1d >> 1) & 0x07;
+	m.cr = m.cr < 1 ? 1 : m.cr > 4 ? 4 : m.cr;
+	m.implicit_header = reg_1d & 0x01;
+	m.sf = reg_1e >> 4;
+	m.sf = m.sf < 6 ? 6 : m.sf > 12 ? 12 : m.sf;
+	m.crc = reg_1e & 0x04;
+	m.low_rate_opt = reg_26 & 0x08;
+
+	return m;
+}
+
+#define MODEM_PREAMBLE 8 // Symbols, RadioHead's default.
+#define MODEM_RH_HEADER 4 // RadioHead's to/from/id/flags bytes ahead of every payload.
+
+// Time on air in us for a len byte RadioHead payload (Semtech AN1200.13).
+static inline uint64_t modem_airtime_us(const modem_params& m, size_t len) {
+	double symbol = (double)(1 << m.sf) / m.bw;
+	int pl = (int)(len + MODEM_RH_HEADER);
+	int num = 8 * pl - 4 * (int)m.sf + 28 + (m.crc ? 16 : 0) - (m.implicit_header ? 20 : 0);
+	int den = 4 * ((int)m.sf - (m.low_rate_opt ? 2 : 0));
+	int blocks = num > 0 ? (num + den - 1) / den : 0;
+	double symbols = MODEM_PREAMBLE + 4.25 + 8 + blocks * (m.cr + 4);
+
+	return (uint64_t)(symbols * symbol * 1e6);
+}
+
+#endif //MODEM_H
@@ -15,31 +15,187 @@
 #include <string>
 #include <bitset>
 #include <iostream>
+#include <array>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <chrono>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <bcm2835.h>
 #include <RTIMULib.h>
 #include <asio.hpp>
 
 #include "common.h"
+#include "events.h"
+#include "telemetry.h"
+#include "delta.h"
+#include "spsc.h"
+#include "recorder.h"
+#include "flightlog.h"
+#include "sample_buffer.h"
+#include "fusion.h"
+#include "flight_phase.h"
+#include "modem.h"
+#include "tx_schedule.h"
+#include "sensor_source.h"
+#include "scheduler.h"
+#include "realtime.h"
+#include "battery.h"
 
 using asio::ip::udp;
 
 std::string comms_ip = "192.168.1.1";
 
 int tx_interval = 1000; // Interval between message sending in ms.
+int sample_rate = 1000; // IMU acquisition rate in Hz, for both IMUs.
+uint8_t drdy_pin = SCHED_NO_PIN; // mpu_main data-ready GPIO, if wired.
+int display_rate = 10; // Console status line updates per second. 0 disables the console display.
+int delta_interval = 0; // Keyframe every this many frames, deltas in between. 0 sends only full frames.
+bool bb_enabled = true; // Full-rate black-box recording to SD.
+bool bb_direct = false; // Open black-box segments with O_DIRECT.
+std::string bb_dir = "blackbox";
+std::string flog_file; // Columnar telemetry log of every sample. Empty disables it.
+bool flog_compress = true;
+bool sim = false; // Synthetic flight instead of the IMUs.
+std::string sim_replay; // Black-box recording to play instead of the IMUs.
+double sim_speed = 1; // Simulated time per real time.
+bool phase_rates = false; // TX cadence, field sets and flight log density by flight phase instead of --interval.
+double airtime_budget = 0.5; // Share of the radio's airtime telemetry may use with --phase-rates.
+bool radio_adaptive = false; // The radio runs --adaptive, so airtime is charged at the slowest profile it may be on.
+bool battery_enabled = true; // Battery voltage from the ADC for TLM_VOLTS.
+
+#define TX_QUEUE_SIZE 16 // Frames waiting for the network thread. The oldest is dropped when full.
+
+// Telemetry per flight phase with --phase-rates (tx_schedule.h). The IMUs, fusion and the black box
+// keep running at --rate in every phase; what changes is how often a frame goes out, what's in it,
+// and how many samples the flight log keeps, so the pad wait doesn't cost what boost and apogee are
+// worth. After landing, bursts give the recovery crew's receiver a better chance at a fix.
+#define TX_STATUS (TX_FIELD(TLM_FPS) | TX_FIELD(TLM_ERR) | TX_FIELD(TLM_ALT) | TX_FIELD(TLM_TEMP) | TX_FIELD(TLM_VOLTS))
+#define TX_ATTITUDE (TX_FIELD(TLM_ROLL) | TX_FIELD(TLM_PITCH) | TX_FIELD(TLM_YAW))
+
+tx_rate tx_plan[PHASE_COUNT] = {
+	{5000, 1, 0, TX_STATUS | TX_ATTITUDE}, // pad: 0.2 Hz, and how it sits on the rail.
+	{100, 1, 0, TX_ALL_FIELDS}, // boost: 10 Hz
+	{100, 1, 0, TX_ALL_FIELDS}, // burnout
+	{200, 1, 0, TX_ALL_FIELDS}, // coast: 5 Hz
+	{100, 1, 0, TX_ALL_FIELDS}, // apogee: 10 Hz
+	{500, 1, 0, TX_STATUS | TX_ATTITUDE | TX_FIELD(TLM_AZ)}, // drogue: 2 Hz
+	{500, 1, 0, TX_STATUS | TX_ATTITUDE | TX_FIELD(TLM_AZ)}, // main
+	{10000, 5, 200, TX_STATUS} // landed: 5 frames every 10 s.
+};
+
+int phase_log_every[PHASE_COUNT] = {10, 1, 1, 1, 1, 1, 1, 10}; // Flight log keeps one sample in this many.
 
 std::string usage = "Usage:\n"
 "    -h, --help       | Show this help message.\n"
-"    --interval   <#> | Sets the TX interval (in milliseconds). Default 1000 ms.\n";
+"    --interval   <#> | Sets the TX interval (in milliseconds). Default 1000 ms.\n"
+"    --ip      <addr> | Telemetry destination. Default 192.168.1.1.\n"
+"    --rate       <#> | IMU acquisition rate in Hz, 1 to 1000000. Default 1000.\n"
+"    --drdy       <#> | Pace mpu_main off its data-ready interrupt on this GPIO instead of the system timer.\n"
+"    --display    <#> | Console status updates per second, 0 to disable. Default 10.\n"
+"    --delta      <#> | Send a keyframe every # frames and delta records in between. Default 0 (off).\n"
+"    --realtime       | SCHED_FIFO priorities, CPU pinning and locked memory for the flight threads.\n"
+"    --blackbox <dir> | Black-box directory; each run records into a new numbered directory in it. Default ./blackbox.\n"
+"    --no-blackbox    | Disables the black-box recorder.\n"
+"    --odirect        | Writes black-box segments with O_DIRECT, bypassing the page cache.\n"
+"    --flightlog <f>  | Logs every telemetry sample to a columnar flight log.\n"
+"    --flightlog-raw  | Stores flight log columns uncompressed.\n"
+"    --sim            | Flies a synthetic flight instead of reading the IMUs. Needs no Pi hardware.\n"
+"    --replay   <dir> | Plays a black-box run (e.g. blackbox/0000) instead of reading the IMUs. Needs no Pi hardware.\n"
+"    --speed      <#> | Runs --sim/--replay # times faster than real time, 1 to 1000. Default 1.\n"
+"    --phase-rates    | Sets TX rate, frame contents and flight log density by flight phase instead of --interval.\n"
+"    --airtime    <#> | Max share of the radio's airtime for --phase-rates telemetry, in percent. Default 50.\n"
+"    --adaptive       | The radio runs --adaptive: charge airtime at the slowest profile it may pick for the altitude.\n"
+"    --no-battery     | Disables the battery ADC; VOLTS is sent as -1.\n";
 
 RTIMU* mpu_main;
 RTIMU* mpu_aux;
 RTPressure* baro;
 
+// What the acquisition loops read: the IMUs above, or a simulation.
+sensor_source* main_source;
+sensor_source* aux_source;
+bool baro_ok = false; // main_source includes barometer readings.
+
+// Battery voltage, read on its own thread (battery.h). SPI0 is shared with radio's RF95.
+battery_monitor battery;
+spi_lock spi0;
+
 asio::io_service io_service;
-udp::socket s;
+udp::socket s(io_service);
 udp::endpoint endpoint;
 
+// Network TX path. The sensor loop only pushes frames into tx_queue and pokes tx_event_fd; the
+// net thread owns the socket and sends with async_send_to, so a stalled socket can cost queued
+// frames but never acquisition time.
+// One datagram: a full frame, or a delta record no longer than one.
+struct tx_datagram {
+	uint8_t len;
+	tlm_frame data;
+};
+
+spsc_overwrite_queue<tx_datagram, TX_QUEUE_SIZE> tx_queue;
+int tx_event_fd = -1;
+asio::posix::stream_descriptor tx_wakeup(io_service);
+uint64_t tx_wakeup_count; // eventfd read target.
+tx_datagram tx_in_flight; // Owned by the net thread while a send is outstanding.
+bool tx_sending = false; // Net thread only.
+
+std::atomic<uint64_t> tx_queued(0);
+std::atomic<uint64_t> tx_sent(0);
+std::atomic<uint64_t> tx_dropped(0);
+std::atomic<uint64_t> tx_errors(0);
+std::atomic<size_t> tx_max_depth(0);
+
+// Samples handed from the sensor loop to the console display thread.
+struct display_sample {
+	float roll, pitch, yaw;
+	float ax, ay, az;
+	float gx, gy, gz;
+	uint8_t phase;
+};
+
+spsc_queue<display_sample, 256> display_queue;
+std::atomic<uint64_t> display_dropped(0);
+
+blackbox bb;
+flightlog_writer flog;
+
+// Per-IMU sample histories, stamped from the bcm2835 system timer so they share a timebase.
+sample_history<bb_record, 256> main_history;
+sample_history<bb_record, 256> aux_history;
+bool aux_ok = false;
+
+fusion_config fusion_cfg = default_fusion_config(); // init_sensors() fills in the configured ranges.
+imu_fusion* fusion; // Built from fusion_cfg once the sensors are up.
+phase_detector phase(default_phase_config()); // Axis must match the IMU's mounting.
+modem_selector radio_selector; // The radio's selector as far as altitude goes; payload never sees link reports.
+
+latency_histogram aux_jitter;
+
+// Heap allocation counter. Everything in this binary allocates through operator new, so replacing
+// it here lets us check that the flight loop never touches the allocator once it's running.
+std::atomic<uint64_t> alloc_count(0);
+
+void* operator new(size_t size) {
+	alloc_count++;
+
+	void* p = malloc(size ? size : 1);
+	if(p == NULL)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
 // Flag for Ctrl-C.
 volatile sig_atomic_t exiting = false;
 
@@ -48,26 +204,278 @@ void sig_handler(int sig) {
 	exiting = true;
 }
 
-void error(uint8_t err_code, bool err_fatal, bool err_noradio, std::string err_message) {
-	if(!err_message.empty()) {
-		if(err_fatal)
-			printf("*FATAL*: %s\n", err_message);
+// Errors and events (events.h). The display thread prints them; the flight loop puts errors in
+// TLM_ERR and sends everything not marked noradio as event frames.
+event_ring<EVT_RING_SIZE> events;
+event_ring<EVT_RING_SIZE>::cursor console_events; // Main thread until the display thread starts, then the display thread.
+
+// Safe from any thread in flight: never blocks, never allocates. err_message must be a string
+// literal. A fatal error ends the flight loop, which sends what's left in the ring on its way out.
+void error(uint8_t err_code, bool err_fatal, bool err_noradio, const char* err_message, int32_t arg = 0) {
+	events.push(err_code, (err_fatal ? EVT_FATAL : 0) | (err_noradio ? EVT_NORADIO : 0), arg, err_message, st_read());
+
+	if(err_fatal)
+		exiting = true;
+}
+
+void print_events() {
+	event_record r;
+
+	while(events.read(console_events, r))
+		event_print(stdout, r);
+}
+
+bb_record imu_record(bb_source source, uint64_t timestamp, const RTIMU_DATA& data) {
+	bb_record r;
+
+	memset(&r, 0, sizeof(r));
+	r.timestamp = timestamp;
+	r.source = source;
+	r.valid = (data.accelValid ? BB_VALID_ACCEL : 0) | (data.gyroValid ? BB_VALID_GYRO : 0) |
+	          (data.compassValid ? BB_VALID_COMPASS : 0) | (data.fusionPoseValid ? BB_VALID_POSE : 0);
+
+	r.accel[0] = data.accel.x(); r.accel[1] = data.accel.y(); r.accel[2] = data.accel.z();
+	r.gyro[0] = data.gyro.x(); r.gyro[1] = data.gyro.y(); r.gyro[2] = data.gyro.z();
+	r.compass[0] = data.compass.x(); r.compass[1] = data.compass.y(); r.compass[2] = data.compass.z();
+	r.pose[0] = data.fusionPose.x() * RTMATH_RAD_TO_DEGREE;
+	r.pose[1] = data.fusionPose.y() * RTMATH_RAD_TO_DEGREE;
+	r.pose[2] = data.fusionPose.z() * RTMATH_RAD_TO_DEGREE;
+
+	return r;
+}
+
+bb_record baro_record(uint64_t timestamp, const RTIMU_DATA& data) {
+	bb_record r;
+
+	memset(&r, 0, sizeof(r));
+	r.timestamp = timestamp;
+	r.source = BB_BARO;
+	r.valid = (data.pressureValid ? BB_VALID_PRESSURE : 0) | (data.temperatureValid ? BB_VALID_TEMP : 0);
+	r.pressure = data.pressure;
+	r.temperature = (int16_t)(data.temperature * 100);
+
+	return r;
+}
+
+// Low-priority console thread. Drains display_queue and prints only the newest sample,
+// display_rate times a second, so terminal I/O never runs on the sensor loop. Also prints errors
+// and events as they're raised, so it runs even with the status line off.
+void display_loop() {
+	rt_thread("display", 0, RT_CPU_BACKGROUND);
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	display_sample sample;
+	bool have_sample = false;
+
+	while(!exiting) {
+		while(display_queue.pop(sample))
+			have_sample = true;
+
+		print_events();
+
+		if(have_sample && display_rate > 0) {
+			printf("roll=%f, pitch=%f, yaw=%f -- Ax=%f, Ay=%f, Az=%f -- Gx=%f, Gy=%f, Gz=%f -- %-7s\r", sample.roll, sample.pitch, sample.yaw,
+																		sample.ax, sample.ay, sample.az,
+																		sample.gx, sample.gy, sample.gz, phase_name(sample.phase));
+			fflush(stdout);
+			have_sample = false;
+		}
+
+		std::this_thread::sleep_for(std::chrono::microseconds(1000000 / (display_rate > 0 ? display_rate : 10)));
+	}
+}
+
+void tx_send_next() {
+	uint64_t dropped = 0;
+	bool have = tx_queue.pop(tx_in_flight, dropped);
+
+	tx_dropped += dropped;
+	tx_sending = have;
+
+	if(dropped)
+		error(ERR_TX_DROPPED, false, false, "TX queue full, dropped the oldest frame", (int32_t)tx_dropped.load());
+
+	if(!have)
+		return;
+
+	s.async_send_to(asio::buffer(tx_in_flight.data, tx_in_flight.len), endpoint, [](const asio::error_code& ec, size_t) {
+		if(ec)
+			tx_errors++;
 		else
-			printf(" ERROR : %s\n", err_message);
+			tx_sent++;
+
+		tx_send_next();
+	});
+}
+
+void tx_wait() {
+	tx_wakeup.async_read_some(asio::buffer(&tx_wakeup_count, sizeof(tx_wakeup_count)), [](const asio::error_code& ec, size_t) {
+		if(ec)
+			return;
+
+		if(!tx_sending)
+			tx_send_next();
+
+		tx_wait();
+	});
+}
+
+void net_loop() {
+	rt_thread("net", RT_PRIO_NET, RT_CPU_NET);
+
+	asio::io_service::work work(io_service);
+
+	tx_wait();
+	io_service.run();
+}
+
+// Called from the sensor loop. Never blocks: the eventfd is non-blocking and the queue drops oldest.
+void tx_enqueue(const tx_datagram& datagram) {
+	tx_queue.push(datagram);
+	tx_queued++;
+
+	size_t depth = tx_queue.size();
+	if(depth > tx_max_depth)
+		tx_max_depth = depth;
+
+	uint64_t one = 1;
+	if(write(tx_event_fd, &one, sizeof(one)) != sizeof(one))
+		tx_errors++;
+}
+
+// Auxiliary IMU acquisition. Runs on its own thread and poll schedule so reading mpu_aux
+// never delays the main IMU loop.
+void aux_loop() {
+	rt_thread("acq_aux", RT_PRIO_ACQ_AUX, RT_CPU_ACQ_AUX);
+
+	acq_scheduler sched(sample_rate);
+
+	sched.start();
+
+	while(!exiting) {
+		sched.wait();
+
+		RTIMU_DATA mpu_auxData;
+
+		while(aux_source->read(mpu_auxData)) {
+			bb_record sample = imu_record(BB_MPU_AUX, st_read(), mpu_auxData);
+
+			aux_history.push(sample);
+
+			if(bb_enabled && !bb.record(sample))
+				error(ERR_BLACKBOX_DROPPED, false, false, "black-box queue full");
+		}
 	}
 
-	if(!err_noradio) {
-		char fstring[256];
-		
-		uint8_t len = strlen(fstring) + 1;
-		uint8_t* data = (uint8_t*)malloc(sizeof(uint8_t) * len);
-		strcpy((char*)data, (char*)fstring);
+	aux_jitter = sched.stats();
+}
+
+// Battery ADC readings. Low priority: a reading only needs to be fresh to a fraction of a second,
+// and the flight loop takes the cached value. Under --realtime spi0's ceiling lifts it to the
+// radio's priority for each conversion so it can't be preempted holding the bus.
+void battery_loop() {
+	rt_thread("battery", 0, RT_CPU_BACKGROUND);
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
 
+	while(!exiting) {
+		switch(battery.sample(st_read())) {
+		case BATTERY_RAIL:
+			error(ERR_BATTERY_ADC, false, false, "battery ADC reads a rail");
+			break;
+		case BATTERY_WENT_LOW:
+			error(ERR_BATTERY_LOW, false, false, "battery voltage low", battery.decivolts());
+			break;
+		default:
+			break;
+		}
 
+		std::this_thread::sleep_for(std::chrono::microseconds(1000000 / BATTERY_RATE));
 	}
+}
 
-	if(err_fatal)
-		while(true) {}
+uint8_t tlm_err = 0; // Error code for TLM_ERR, taken from the ring once per frame sent.
+
+// Next error for TLM_ERR, skipping console-only errors and events. 0 when there is none.
+uint8_t next_error(event_ring<EVT_RING_SIZE>::cursor& c) {
+	event_record r;
+
+	while(events.read(c, r))
+		if(!(r.flags & (EVT_NORADIO | EVT_INFO)))
+			return r.code;
+
+	return 0;
+}
+
+// Queues the next event as an event frame. The radio sends them between telemetry packets.
+bool send_event(event_ring<EVT_RING_SIZE>::cursor& c) {
+	event_record r;
+
+	while(events.read(c, r))
+		if(!(r.flags & EVT_NORADIO)) {
+			tx_datagram datagram;
+
+			event_pack(r, datagram.data.data());
+			datagram.len = EVENT_LEN;
+			tx_enqueue(datagram);
+			return true;
+		}
+
+	return false;
+}
+
+// Telemetry values for one sample, everything but TLM_SEQ.
+// TLM_ALT: the phase detector's height above the pad, which is also what the radio's modem
+// selector goes by. Relative to the pad it fits the 12 bit field wherever the launch site is.
+int tlm_altitude() {
+	int alt = int(phase.altitude());
+	int max = (1 << tlm_schema::field_bits(TLM_ALT)) - 1;
+
+	return alt < 0 ? 0 : alt > max ? max : alt;
+}
+
+void fill_telemetry(int64_t* tlm, const bb_record& fused, const RTIMU_DATA& mpu_mainData) {
+	tlm[TLM_FPS] = phase.phase();
+	tlm[TLM_ERR] = tlm_err;
+	tlm[TLM_AX] = int(fused.accel[0] * 10);
+	tlm[TLM_AY] = int(fused.accel[1] * 10);
+	tlm[TLM_AZ] = int(fused.accel[2] * 10);
+	tlm[TLM_GX] = int(fused.gyro[0]);
+	tlm[TLM_GY] = int(fused.gyro[1]);
+	tlm[TLM_GZ] = int(fused.gyro[2]);
+	tlm[TLM_ROLL] = int(fused.pose[0]);
+	tlm[TLM_PITCH] = int(fused.pose[1]);
+	tlm[TLM_YAW] = int(fused.pose[2]);
+	tlm[TLM_ALT] = tlm_altitude();
+	tlm[TLM_TEMP] = int(mpu_mainData.temperature);
+	tlm[TLM_VOLTS] = battery.decivolts();
+}
+
+// The modem profile the radio is expected to be on, to charge airtime against.
+modem_params radio_modem() {
+	int profile = MODEM_DEFAULT_PROFILE;
+
+	if(radio_adaptive) {
+		// radio holds the default until it hears the ground, then goes no faster than the altitude
+		// allows; charge at the slower of the two.
+		radio_selector.altitude(tlm_altitude());
+
+		if(radio_selector.altitude_rank() > profile)
+			profile = radio_selector.altitude_rank();
+	}
+
+	return modem_decode(modem_profiles[profile].reg_1d, modem_profiles[profile].reg_1e, modem_profiles[profile].reg_26);
+}
+
+void print_phases() {
+	uint64_t launch = phase.entered_at(PHASE_BOOST);
+
+	printf("Flight phase: %s, apogee %.0f m", phase_name(phase.phase()), phase.apogee());
+
+	for(int p = PHASE_BOOST; p < PHASE_COUNT; p++)
+		if(phase.entered_at(p))
+			printf(", %s T+%.2f s", phase_name(p), (phase.entered_at(p) - launch) / 1e6);
+
+	putchar('\n');
 }
 
 void flight_loop() {
@@ -75,104 +483,191 @@ void flight_loop() {
 
 	uint64_t now;
 	uint64_t tx_timer;
+	uint64_t alloc_start = alloc_count;
+	uint8_t tx_seq = 0;
+	uint64_t flog_count = 0;
+	delta_encoder delta(delta_interval);
+	tx_scheduler tx_sched(tx_plan, airtime_budget);
+	event_ring<EVT_RING_SIZE>::cursor tlm_events;
+	event_ring<EVT_RING_SIZE>::cursor radio_events;
+	flight_phase last_phase = PHASE_PAD;
+	uint8_t health = 0;
+	uint64_t missed = 0;
 
-	tx_timer = RTMath::currentUSecsSinceEpoch();
+	RTIMU_DATA mpu_mainData; // Newest mpu_main read, and the barometer and temperature with it.
+	uint64_t last_main;
 
-	while(!exiting) {
-		bcm2835_delay(mpu_main->IMUGetPollInterval());
+	mpu_mainData.pressureValid = false;
+	mpu_mainData.pressure = 0;
+	mpu_mainData.temperature = 0;
 
-		while(mpu_main->IMURead()) {
-			now = RTMath::currentUSecsSinceEpoch();
+	// Everything downstream of the IMUs, once per main sample, or once per tick on mpu_aux alone
+	// when main_sample is NULL.
+	auto step = [&](const bb_record* main_sample, bool baro_valid) {
+		bb_record aux_sample;
+		bool have_aux = aux_ok && aux_history.nearest(now, aux_sample);
+		const bb_record& fused = fusion->update(main_sample, have_aux ? &aux_sample : NULL, now);
 
-			RTIMU_DATA mpu_mainData = mpu_main->getIMUData();
+		if(fusion->status() != health) {
+			if((fusion->status() & ~health) & FUSION_MAIN_FAILED)
+				error(ERR_IMU_MAIN_FAILED, false, false, "mpu_main voted out, flying on mpu_aux");
+			if((fusion->status() & ~health) & FUSION_AUX_FAILED)
+				error(ERR_IMU_AUX_FAILED, false, false, "mpu_aux voted out");
+			if((fusion->status() & ~health) & FUSION_HOLDING)
+				error(ERR_FUSION_HOLDING, false, false, "no usable IMU, holding the last estimate");
 
-			if (baro != NULL)
-				baro->pressureRead(mpu_mainData);
+			health = fusion->status();
+		}
 
-			printf("roll=%f, pitch=%f, yaw=%f -- Ax=%f, Ay=%f, Az=%f -- Gx=%f, Gy=%f, Gz=%f\r", mpu_mainData.fusionPose.x() * RTMATH_RAD_TO_DEGREE,
-																		mpu_mainData.fusionPose.y() * RTMATH_RAD_TO_DEGREE,
-																		mpu_mainData.fusionPose.z() * RTMATH_RAD_TO_DEGREE,
-																		mpu_mainData.accel.x(), mpu_mainData.accel.y(), mpu_mainData.accel.z(),
-																		mpu_mainData.gyro.x(), mpu_mainData.gyro.y(), mpu_mainData.gyro.z());
-			fflush(stdout);
+		flight_phase fps = phase.update(now, fused.accel, baro_valid, baro_valid ? RTMath::convertPressureToHeight(mpu_mainData.pressure) : 0);
+		modem_params modem = phase_rates ? radio_modem() : modem_params();
+
+		if(fps != last_phase) {
+			events.push(EVT_PHASE, EVT_INFO, fps, phase_name(fps), now);
+			last_phase = fps;
+		}
+
+		if(display_rate > 0) {
+			display_sample sample = {
+				fused.pose[0], fused.pose[1], fused.pose[2],
+				fused.accel[0], fused.accel[1], fused.accel[2],
+				fused.gyro[0], fused.gyro[1], fused.gyro[2],
+				uint8_t(fps)
+			};
+
+			if(!display_queue.push(sample))
+				display_dropped++;
+		}
+
+		// Every sample goes to the flight log (one in log_every with --phase-rates), tagged with the
+		// seq of the next frame to be sent.
+		if(!flog_file.empty() && (!phase_rates || flog_count++ % phase_log_every[fps] == 0)) {
+			int64_t tlm[TLM_FIELD_COUNT];
+
+			fill_telemetry(tlm, fused, mpu_mainData);
+			tlm[TLM_SEQ] = tx_seq;
+
+			if(!flog.log(now, tlm))
+				error(ERR_FLIGHTLOG_DROPPED, false, false, "flight log queue full");
+		}
+
+		if(phase_rates ? tx_sched.due(now, fps, modem) : (now - tx_timer) > (tx_interval * 1000)) {
+			/*char fstring[16];
+			sprintf(fstring,
+				"roll=%f, pitch=%f, yaw=%f -- Ax=%f, Ay=%f, Az=%f", mpu_mainData.fusionPose.x() * RTMATH_RAD_TO_DEGREE,
+																	mpu_mainData.fusionPose.x() * RTMATH_RAD_TO_DEGREE,
+																	mpu_mainData.fusionPose.x() * RTMATH_RAD_TO_DEGREE,
+																	mpu_mainData.accel.x(), mpu_mainData.accel.y(), mpu_mainData.accel.z());
+			uint8_t len = strlen(fstring) + 1;
+			uint8_t* data = (uint8_t*)malloc(sizeof(uint8_t) * len);
+			strcpy((char*)data, (char*)fstring);*/
+
+			int64_t tlm[TLM_FIELD_COUNT];
 
-			if((now - tx_timer) > (tx_interval * 1000)) {
-				/*char fstring[16];
-				sprintf(fstring,
-					"roll=%f, pitch=%f, yaw=%f -- Ax=%f, Ay=%f, Az=%f", mpu_mainData.fusionPose.x() * RTMATH_RAD_TO_DEGREE,
-																		mpu_mainData.fusionPose.x() * RTMATH_RAD_TO_DEGREE,
-																		mpu_mainData.fusionPose.x() * RTMATH_RAD_TO_DEGREE,
-																		mpu_mainData.accel.x(), mpu_mainData.accel.y(), mpu_mainData.accel.z());
-				uint8_t len = strlen(fstring) + 1;
-				uint8_t* data = (uint8_t*)malloc(sizeof(uint8_t) * len);
-				strcpy((char*)data, (char*)fstring);*/
-
-				uint64_t group1 = 0;
-
-				pack_int(group1, 0, 6); // TODO 1 - [6]  flight profile state - (6-bit field)
-				pack_int(group1, 0, 6); // TODO 2 - [6]  error buffer - (6-bit field)
-				pack_int(group1, int(mpu_mainData.accel.x() * 10), 6); // 3 - [6]  Ax - [-32, 31] - real values: [-20, 20]
-				pack_int(group1, int(mpu_mainData.accel.y() * 10), 6); // 4 - [6]  Ay - [-32, 31] - real values: [-20, 20]
-				pack_int(group1, int(mpu_mainData.accel.z() * 10), 9); // 5 - [9]  Az - [-256, 255] - real values: [-160, 160]
-				pack_int(group1, int(mpu_mainData.gyro.x()), 10); // 6 - [10] Gx - [-512, 511] - real values: [-500, 500]
-				pack_int(group1, int(mpu_mainData.gyro.y()), 10); // 7 - [10] Gy - [-512, 511] - real values: [-500, 500]
-				// ONLY SEND 11 BITS for the next one so we don't push the 1st bit off the end
-				pack_int(group1, int(mpu_mainData.gyro.z()), 11); // 8 - [12] Gz - [-2048, 2047] - real values: [-2000, 2000]
-
-				std::cout << std::bitset<64>(group1) << std::endl;
-
-				uint64_t group2 = 0;
-
-				pack_int(group2, int(mpu_mainData.gyro.z()), 12); // 8 - [12] Gz - [-2048, 2047] - real values: [-2000, 2000]
-				pack_int(group2, int(mpu_mainData.fusionPose.x() * RTMATH_RAD_TO_DEGREE), 9); // 9  - [9]  roll   - [-256, 255] - real values: (-180, 180)
-				pack_int(group2, int(mpu_mainData.fusionPose.y() * RTMATH_RAD_TO_DEGREE), 9); // 10 - [9]  pitch - [-256, 255] - real values: (-180, 180)
-				pack_int(group2, int(mpu_mainData.fusionPose.z() * RTMATH_RAD_TO_DEGREE), 9); // 11 - [9]  yaw  - [-256, 255] - real values: (-180, 180)
-				pack_int(group2, int(RTMath::convertPressureToHeight(mpu_mainData.pressure)), 12); // 12 - [12] alt. - [0, 4095] - real values: ~[0, 3200] (est. values. prob unsigned w/ addition)
-				pack_int(group2, int(mpu_mainData.temperature), 8); // 13 - [8]  temp. - [0, 255] - real values: ~[-30, 100] (not sure if we'll go negative, add +30?)
-				pack_int(group2, -1, 8); // TODO 14 - [8]  volts - [0, 255] - real values: ~[20, 170] (looking at nominal maximum of 14-ish V)
-				pack_int(group2, 0, 8); // last byte RESERVED. Needed to push off the last few bits of gyro.z, so only the last bit remains.
-
-				std::cout << std::bitset<64>(group2) << std::endl;
-
-				uint8_t len = 18;
-				uint8_t* data = (uint8_t*)malloc(sizeof(uint8_t) * len);
-
-				data[0] = '\x5e';
-
-				data[1] = (uint8_t)unpack_int(group1, 8, false);
-				data[2] = (uint8_t)unpack_int(group1, 8, false);
-				data[3] = (uint8_t)unpack_int(group1, 8, false);
-				data[4] = (uint8_t)unpack_int(group1, 8, false);
-				data[5] = (uint8_t)unpack_int(group1, 8, false);
-				data[6] = (uint8_t)unpack_int(group1, 8, false);
-				data[7] = (uint8_t)unpack_int(group1, 8, false);
-				data[8] = (uint8_t)unpack_int(group1, 8, false);
-				
-				data[9] = (uint8_t)unpack_int(group2, 8, false);
-				data[10] = (uint8_t)unpack_int(group2, 8, false);
-				data[11] = (uint8_t)unpack_int(group2, 8, false);
-				data[12] = (uint8_t)unpack_int(group2, 8, false);
-				data[13] = (uint8_t)unpack_int(group2, 8, false);
-				data[14] = (uint8_t)unpack_int(group2, 8, false);
-				data[15] = (uint8_t)unpack_int(group2, 8, false);
-				data[16] = (uint8_t)unpack_int(group2, 8, false);
-
-				data[17] = '\xd5';
-
-				std::cout << std::hex << data;
-
-				s.send_to(asio::buffer(data, len), endpoint);
+			tlm_err = next_error(tlm_events);
+			fill_telemetry(tlm, fused, mpu_mainData);
+			tlm[TLM_SEQ] = tx_seq++;
+
+			if(phase_rates)
+				tx_sched.select(tlm, delta_interval == 0 || delta.keyframe_next());
+
+			tx_datagram datagram;
+
+			if(delta_interval > 0)
+				datagram.len = delta.encode(tlm, datagram.data.data());
+			else {
+				tlm_schema::pack_frame(tlm, datagram.data.data());
+				datagram.len = FRAME_LEN;
+			}
+
+			tx_enqueue(datagram);
+
+			if(phase_rates)
+				tx_sched.sent(now, datagram.len, modem);
 
 /*				printf("SEND <%d> [%02db]: ", time(NULL), len);
-				printbuffer(data, len);
-				printf("\n");*/
+			printbuffer(data, len);
+			printf("\n");*/
+
+			tx_timer = st_read();
+		}
+	};
+
+	rt_thread("acq_main", RT_PRIO_ACQ_MAIN, RT_CPU_ACQ_MAIN);
+
+	acq_scheduler sched(sample_rate, drdy_pin);
+
+	sched.start();
+	tx_timer = last_main = st_read();
+
+	while(!exiting) {
+		sched.wait();
+
+		if(sched.missed() != missed) {
+			missed = sched.missed();
+			error(ERR_SCHED_OVERRUN, false, false, "main acquisition missed a deadline", (int32_t)missed);
+		}
+
+		bool main_read = false;
+
+		while(main_source->read(mpu_mainData)) {
+			now = last_main = st_read();
+			main_read = true;
 
-				tx_timer = RTMath::currentUSecsSinceEpoch();
+			bb_record main_sample = imu_record(BB_MPU_MAIN, now, mpu_mainData);
+
+			main_history.push(main_sample);
+
+			if(bb_enabled) {
+				bool recorded = bb.record(main_sample);
+
+				if(baro_ok)
+					recorded &= bb.record(baro_record(now, mpu_mainData));
+
+				if(!recorded)
+					error(ERR_BLACKBOX_DROPPED, false, false, "black-box queue full");
 			}
+
+			step(&main_sample, baro_ok && mpu_mainData.pressureValid);
+		}
+
+		// mpu_main has gone quiet for longer than fusion waits for it: keep fusing, tracking the
+		// phase and sending at the tick rate on mpu_aux alone (or on the held estimate, flagged).
+		// The barometer is read with mpu_main, so ALT and TEMP hold their last values.
+		now = st_read();
+
+		if(!main_read && now - last_main > fusion->stale_us())
+			step(NULL, false);
+
+		// At most one event frame per wakeup, so a burst of errors can't crowd out telemetry.
+		send_event(radio_events);
+
+		if(main_source->finished()) {
+			puts("Simulation finished.");
+			exiting = true;
 		}
 	}
 
+	while(send_event(radio_events)) {}
+
 	puts("Exiting main flight loop... (wtf?!)");
+	printf("Heap allocations during flight: %llu\n", (unsigned long long)(alloc_count - alloc_start));
+	printf("Console samples dropped: %llu\n", (unsigned long long)display_dropped.load());
+	printf("IMU samples: main %llu, aux %llu\n", (unsigned long long)main_history.size(), (unsigned long long)aux_history.size());
+	printf("IMU health: main %s, aux %s\n", fusion->imu_failed(0) ? "FAILED" : "ok", fusion->imu_failed(1) ? "FAILED" : "ok");
+	print_phases();
+
+	if(phase_rates)
+		printf("Telemetry airtime: %.1f s at %.0f%% budget, %llu frames waited for airtime.\n", tx_sched.airtime_us() / 1e6,
+			airtime_budget * 100, (unsigned long long)tx_sched.deferred());
+	printf("Main acquisition: %u us period, %llu deadlines missed.\n", sched.period_us(), (unsigned long long)sched.missed());
+	sched.stats().print("Main acquisition jitter");
+	sched.period_stats().print("Main loop period deviation");
+	printf("Worst-case main loop period: %lld us\n", (long long)sched.worst_period_us());
+
+	if(sim || !sim_replay.empty())
+		printf("Simulation at %gx: samples skipped behind schedule: main %llu, aux %llu\n", sim_speed,
+			(unsigned long long)main_source->skipped(), aux_ok ? (unsigned long long)aux_source->skipped() : 0ULL);
 }
 
 void parse_args(int argc, const char* argv[]) {
@@ -191,18 +686,154 @@ void parse_args(int argc, const char* argv[]) {
 					exit(EXIT_FAILURE);
 				}
 			}
+
+			if(!strcmp(argv[i], "--blackbox")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					bb_dir = argv[i + 1];
+				else {
+					puts("--blackbox [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--realtime"))
+				realtime = true;
+
+			if(!strcmp(argv[i], "--no-blackbox"))
+				bb_enabled = false;
+
+			if(!strcmp(argv[i], "--odirect"))
+				bb_direct = true;
+
+			if(!strcmp(argv[i], "--flightlog")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					flog_file = argv[i + 1];
+				else {
+					puts("--flightlog [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--flightlog-raw"))
+				flog_compress = false;
+
+			if(!strcmp(argv[i], "--ip")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					comms_ip = argv[i + 1];
+				else {
+					puts("--ip [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--sim"))
+				sim = true;
+
+			if(!strcmp(argv[i], "--phase-rates"))
+				phase_rates = true;
+
+			if(!strcmp(argv[i], "--adaptive"))
+				radio_adaptive = true;
+
+			if(!strcmp(argv[i], "--no-battery"))
+				battery_enabled = false;
+
+			if(!strcmp(argv[i], "--airtime")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-' && atof(argv[i + 1]) > 0 && atof(argv[i + 1]) <= 100)
+					airtime_budget = atof(argv[i + 1]) / 100;
+				else {
+					puts("--airtime [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--replay")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					sim_replay = argv[i + 1];
+				else {
+					puts("--replay [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--speed")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-' && atof(argv[i + 1]) >= 1 && atof(argv[i + 1]) <= 1000)
+					sim_speed = atof(argv[i + 1]);
+				else {
+					puts("--speed [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--rate")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-' && atoi(argv[i + 1]) >= 1 && atoi(argv[i + 1]) <= 1000000)
+					sample_rate = atoi(argv[i + 1]);
+				else {
+					puts("--rate [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--drdy")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					drdy_pin = atoi(argv[i + 1]);
+				else {
+					puts("--drdy [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--delta")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					delta_interval = atoi(argv[i + 1]);
+				else {
+					puts("--delta [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--display")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					display_rate = atoi(argv[i + 1]);
+				else {
+					puts("--display [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
 		}
 	}
+
+	// Phase field sets leave the unsent fields unchanged, which only delta records make cheap.
+	if(phase_rates && delta_interval == 0)
+		delta_interval = DELTA_KEYFRAME_INTERVAL;
 }
 
-int main(int argc, const char* argv[]) {
-	signal(SIGINT, sig_handler);
-	setvbuf(stdout, NULL, _IONBF, 0);
+// Full-scale ranges RTIMULib set IMU i up with (the FSR in its .ini), so fusion knows where each one
+// saturates and weighs it by range. IMU types payload doesn't fly keep the defaults.
+void imu_ranges(int i, RTIMU* imu, RTIMUSettings* settings) {
+	int accel_fsr, gyro_fsr;
 
-	puts("\nSEDS-UCF - IREC 2018 - Telemetry and Experiment Control System (TECS v0.0)\n");
+	switch(imu->IMUType()) {
+	case RTIMU_TYPE_MPU9150:
+		accel_fsr = settings->m_MPU9150AccelFsr;
+		gyro_fsr = settings->m_MPU9150GyroFsr;
+		break;
+	case RTIMU_TYPE_MPU9250:
+		accel_fsr = settings->m_MPU9250AccelFsr;
+		gyro_fsr = settings->m_MPU9250GyroFsr;
+		break;
+	default:
+		printf("WARN: IMU %d is type %d; fusion assumes %.0f g / %.0f dps.\n", i, imu->IMUType(), fusion_cfg.accel_range[i], fusion_cfg.gyro_range[i]);
+		return;
+	}
 
-	parse_args(argc, argv);
+	// Both parts encode the FSR in bits 3-4: 2/4/8/16 g and 250/500/1000/2000 dps.
+	fusion_cfg.accel_range[i] = 2 << (accel_fsr >> 3 & 3);
+	fusion_cfg.gyro_range[i] = 250 << (gyro_fsr >> 3 & 3);
+}
 
+// Flight hardware: both IMUs, the barometer and the bcm2835 peripherals.
+void init_sensors() {
 	RTIMUSettings* mpu_main_settings = new RTIMUSettings("mpu_main");
 	
 	mpu_main = RTIMU::createIMU(mpu_main_settings);
@@ -215,6 +846,7 @@ int main(int argc, const char* argv[]) {
 	mpu_main->setGyroEnable(true);
 	mpu_main->setAccelEnable(true);
 	mpu_main->setCompassEnable(true);
+	imu_ranges(0, mpu_main, mpu_main_settings);
 
 	baro = RTPressure::createPressure(mpu_main_settings);
 	if (baro != NULL) {
@@ -229,32 +861,192 @@ int main(int argc, const char* argv[]) {
 	if ((mpu_aux == NULL) || (mpu_aux->IMUType() == RTIMU_TYPE_NULL))
 		error(ERR_MPU_AUX_NULL, false, false, "mpu_aux NULL");
 
-	if(!mpu_aux->IMUInit())
+	else if(!mpu_aux->IMUInit())
 		error(ERR_MPU_AUX_INIT_FAIL, false, false, "mpu_aux init fail");
-	mpu_aux->setSlerpPower(0.02);
-	mpu_aux->setGyroEnable(true);
-	mpu_aux->setAccelEnable(true);
-	mpu_aux->setCompassEnable(true);
+	else {
+		mpu_aux->setSlerpPower(0.02);
+		mpu_aux->setGyroEnable(true);
+		mpu_aux->setAccelEnable(true);
+		mpu_aux->setCompassEnable(true);
+		imu_ranges(1, mpu_aux, mpu_aux_settings);
+		aux_ok = true;
+	}
+
+	main_source = new rtimu_source(mpu_main, baro);
+	aux_source = aux_ok ? new rtimu_source(mpu_aux) : NULL;
+	baro_ok = baro != NULL;
 
 	if(!bcm2835_init()) {
 		error(ERR_BCM_INIT_FAIL, false, false, "bcm2835 init failure");
+		print_events();
 		exit(EXIT_FAILURE);
 	}
 
+	if(battery_enabled) {
+		// The battery thread holds the bus the SCHED_FIFO radio waits on; run it at the radio's
+		// priority while it does.
+		if(realtime)
+			spi0.set_ceiling(RT_PRIO_RADIO);
+
+		battery.open_spi(spi0);
+
+		if(!spi0.open())
+			puts("WARN: no SPI lock at " SPI_LOCK_FILE "; battery reads may collide with the radio.");
+	}
+}
+
+// --sim/--replay: no sensors and no bcm2835; timestamps come from CLOCK_MONOTONIC at sim_speed.
+void init_simulation() {
+	st_simulated = true;
+	st_speed = sim_speed;
+
+	if(drdy_pin != SCHED_NO_PIN) {
+		puts("Simulation: ignoring --drdy.");
+		drdy_pin = SCHED_NO_PIN;
+	}
+
+	if(!sim_replay.empty()) {
+		replay_source* main_replay = new replay_source;
+		replay_source* aux_replay = new replay_source;
+
+		if(!main_replay->open(sim_replay, BB_MPU_MAIN, true)) {
+			printf("Replay: no mpu_main records in %s/\n", sim_replay.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		main_source = main_replay;
+		aux_source = aux_replay;
+		aux_ok = aux_replay->open(sim_replay, BB_MPU_AUX, false);
+
+		printf("Replaying %s/ at %gx\n", sim_replay.c_str(), sim_speed);
+	} else {
+		main_source = new sim_source(sample_rate, 1, true);
+		aux_source = new sim_source(sample_rate, 2, false);
+		aux_ok = true;
+
+		printf("Simulating a flight at %gx\n", sim_speed);
+	}
+
+	baro_ok = true;
+
+	if(battery_enabled)
+		battery.open_sim(st_read());
+}
+
+int main(int argc, const char* argv[]) {
+	signal(SIGINT, sig_handler);
+	setvbuf(stdout, NULL, _IOLBF, 0); // Line buffered; the display thread flushes its own status line.
+
+	puts("\nSEDS-UCF - IREC 2018 - Telemetry and Experiment Control System (TECS v0.0)\n");
+
+	parse_args(argc, argv);
+
+	if(sim || !sim_replay.empty())
+		init_simulation();
+	else
+		init_sensors();
+
+	fusion = new imu_fusion(fusion_cfg);
+	printf("Fusion ranges: main %.0f g / %.0f dps, aux %.0f g / %.0f dps.\n", fusion_cfg.accel_range[0], fusion_cfg.gyro_range[0],
+		fusion_cfg.accel_range[1], fusion_cfg.gyro_range[1]);
+
 	udp::resolver resolver(io_service);
-	udp::endpoint endpoint = *resolver.resolve({udp::v4(), comms_ip.c_str(), NETWORK_PORT});
+	endpoint = *resolver.resolve({udp::v4(), comms_ip, std::to_string(NETWORK_PORT)});
+
+	s.open(udp::v4());
+
+	tx_event_fd = eventfd(0, EFD_NONBLOCK);
+	if(tx_event_fd < 0) {
+		error(ERR_NET_INIT_FAIL, false, false, "eventfd failure");
+		print_events();
+		exit(EXIT_FAILURE);
+	}
+	tx_wakeup.assign(tx_event_fd);
+
+	if(bb_enabled) {
+		if(bb.open(bb_dir, bb_direct)) {
+			bb.start();
+			printf("Black-box recording to %s/\n", bb.directory().c_str());
+		} else {
+			error(ERR_BLACKBOX_FAIL, false, false, "black-box open fail");
+			bb_enabled = false;
+		}
+	}
+
+	if(!flog_file.empty()) {
+		if(flog.open(flog_file, flog_compress)) {
+			flog.start();
+			printf("Flight log recording to %s\n", flog_file.c_str());
+		} else {
+			error(ERR_FLIGHTLOG_FAIL, false, false, "flight log open fail");
+			flog.stop();
+			flog_file.clear();
+		}
+	}
 
-	s = udp::socket(io_service, udp::endpoint(udp::v4(), 0));
+	if(realtime && rt_lock_memory())
+		puts("Realtime mode: memory locked.");
+
+	print_events();
+
+	std::thread display_thread(display_loop);
+
+	std::thread aux_thread;
+	if(aux_ok)
+		aux_thread = std::thread(aux_loop);
+
+	std::thread net_thread(net_loop);
+
+	std::thread battery_thread;
+	if(battery_enabled)
+		battery_thread = std::thread(battery_loop);
 
 	flight_loop();
 
+	io_service.stop();
+	net_thread.join();
+
+	printf("TX: %llu queued, %llu sent, %llu dropped, %llu errors, max queue depth %zu/%d.\n", (unsigned long long)tx_queued.load(),
+		(unsigned long long)tx_sent.load(), (unsigned long long)tx_dropped.load(), (unsigned long long)tx_errors.load(),
+		tx_max_depth.load(), TX_QUEUE_SIZE);
+
+	if(aux_thread.joinable()) {
+		aux_thread.join();
+		aux_jitter.print("Aux acquisition jitter");
+	}
+
+	if(battery_thread.joinable()) {
+		battery_thread.join();
+		printf("Battery: %.2f V, %.2f V min, %llu readings, %llu ADC rail errors.\n", battery.voltage(), battery.minimum(),
+			(unsigned long long)battery.count(), (unsigned long long)battery.rail_count());
+	}
+
+	display_thread.join();
+	print_events();
+	printf("Events: %llu raised, %llu suppressed as repeats.\n", (unsigned long long)events.pushed(), (unsigned long long)events.suppressed());
+
+	if(bb_enabled) {
+		bb.stop();
+		printf("Black-box: %llu records in %llu blocks, %llu dropped, %llu write errors.\n", (unsigned long long)bb.records_written(),
+			(unsigned long long)bb.blocks_written(), (unsigned long long)bb.records_dropped(), (unsigned long long)bb.errors());
+	}
+
+	if(!flog_file.empty()) {
+		flog.stop();
+		printf("Flight log: %llu samples in %llu chunks (%llu bytes), %llu dropped, %llu write errors.\n", (unsigned long long)flog.samples_written(),
+			(unsigned long long)flog.chunks_written(), (unsigned long long)flog.bytes_written(), (unsigned long long)flog.samples_dropped(),
+			(unsigned long long)flog.errors());
+	}
+
 	// We should never reach this point in flight conditions.
 	// Expect direct shutdown of the Raspberry Pi, with no gracefulness.
 
 	puts("WARN: broke loop! ground test?");
 
-	puts("Closing bcm2835 hook...\n");
-	bcm2835_close();
+	if(!st_simulated) {
+		puts("Closing bcm2835 hook...\n");
+		bcm2835_close();
+	}
 
 	puts("Good bye!\n");
 	return EXIT_SUCCESS;
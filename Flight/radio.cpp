@@ -12,22 +12,42 @@
 #include <cstdint>
 
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
 
 #include <string>
 #include <bitset>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 #include <bcm2835.h>
 #include <RH_RF95.h>
 #include <asio.hpp>
 
 #include "common.h"
+#include "delta.h"
+#include "events.h"
+#include "fec.h"
+#include "histogram.h"
+#include "modem.h"
+#include "radio_driver.h"
+#include "realtime.h"
+#include "spsc.h"
+#include "telemetry.h"
 
 #define RF_CS_PIN RPI_V2_GPIO_P1_24 // Slave Select on CE0 so P1 pin #24
 #define RF_IRQ_PIN RPI_V2_GPIO_P1_22 // IRQ on GPIO25 so P1 pin #22
 #define RF_RST_PIN RPI_V2_GPIO_P1_15 // IRQ on GPIO22 so P1 pin #15
 
+#define RF_QUEUE_SIZE 32 // Packets waiting for the radio. The oldest is dropped when full.
+#define RF_EVENT_QUEUE_SIZE 16 // Event frames from payload waiting for a gap in the telemetry.
+#define RF_EVENT_INTERVAL 8 // With telemetry always waiting, an event still goes out every this many packets.
+#define RF_STATS_INTERVAL_US 10000000
+#define RF_CONSOLE_INTERVAL_MS 100 // Console thread wake-up.
+
 // Our RFM95 configuration.
 #define RF_FREQUENCY 915.00
 #define RF_GROUND_ID 30
@@ -37,19 +57,79 @@ using asio::ip::udp;
 
 int tx_power = 23; // TX power, valid range is 5 to 23.
 bool is_prom = true; // Sets promiscuous mode. Defaults to true.
-char r1d = 0x72, r1e = 0x74;
+uint8_t r1d = 0x72, r1e = 0x74;
+bool modem_fixed = false; // --modem given: use r1d/r1e and never adapt.
+bool adaptive = false; // Switch modem profiles with altitude and ground link reports (modem.h).
+bool fec = false; // Reed-Solomon parity on telemetry packets (fec.h).
+int batch_ms = 0; // Max time a frame may wait to share a radio packet with later ones. 0 sends each datagram alone.
+bool loopback = false; // No RF95: model the channel and hand the result to the ground decoder over UDP.
+std::string ground_ip = "127.0.0.1";
+double loopback_range = LOOPBACK_RANGE;
+double loopback_loss = 0; // Fraction of packets dropped on top of the channel model.
+int bench_spi_iterations = 0; // --bench-spi: time FIFO loads and exit.
 
 std::string usage = "Usage:\n"
 "    -h, --help       | Show this help message.\n"
 "    --modem  <x> <x> | Two bytes to configure the modem. Enter without leading \"0x\". Default 72 74.\n"
+"    --adaptive       | Switch modem profiles with altitude and ground link reports, once the ground has reported. Ignored with --modem.\n"
 "    --power      <#> | Set the TX power to use in flight mode. Valid range is 5 - 23. Default 23.\n"
-"    --no-prom        | Disables promiscuous mode. Be careful!\n";
+"    --no-prom        | Disables promiscuous mode. Be careful!\n"
+"    --batch      <#> | Aggregate telemetry frames into one radio packet, waiting at most this many ms. Default 0 (off).\n"
+"    --fec            | Append Reed-Solomon parity to telemetry packets. The ground must run fec_decode.\n"
+"    --realtime       | SCHED_FIFO priority, CPU pinning and locked memory for the radio loop.\n"
+"    --loopback       | No RF95: simulate the LoRa channel and send what the ground would hear to UDP port 40868.\n"
+"    --ground  <addr> | Loopback destination (tecs-recv). Default 127.0.0.1.\n"
+"    --range      <#> | Loopback distance to the ground station in m, not counting altitude. Default 2000.\n"
+"    --loss       <#> | Loopback random packet loss in percent, on top of the channel model. Default 0.\n"
+"    --bench-spi  <#> | Time # RF95 FIFO loads each way, RadioHead's and burst, then exit. Transmits nothing.\n";
 
 // Create an instance of a driver.
 RH_RF95 rf95(RF_CS_PIN, RF_IRQ_PIN);
+spi_lock spi0; // Shared with payload's battery ADC.
+uint32_t rh_spi_divider; // What RadioHead set the SPI clock to, for --bench-spi.
+
+// What the flight loop transmits through: rf95, or the loopback channel.
+radio_driver* radio;
 
 asio::io_service io_service;
-udp::socket sock;
+udp::socket sock(io_service);
+
+// UDP -> radio pipeline. The net thread receives datagrams asynchronously and queues them; the
+// radio loop starts a transmission whenever the RF95 is idle and learns it finished from the
+// TX-done interrupt on RF_IRQ_PIN, so UDP ingest keeps running during LoRa airtime.
+struct rf_packet {
+	uint64_t received; // st_read() at UDP receive.
+	uint8_t len;
+	uint8_t data[RH_RF95_MAX_MESSAGE_LEN];
+};
+
+spsc_overwrite_queue<rf_packet, RF_QUEUE_SIZE> rf_queue;
+spsc_queue<rf_packet, RF_EVENT_QUEUE_SIZE> event_queue; // Low priority: payload's event frames.
+
+uint8_t udp_buffer[1024];
+udp::endpoint udp_sender;
+
+std::atomic<uint64_t> udp_received(0);
+std::atomic<uint64_t> udp_rejected(0); // Too short to be a frame or delta record.
+std::atomic<uint64_t> udp_truncated(0); // Longer than the RF95 MTU.
+std::atomic<uint64_t> events_dropped(0); // event_queue full.
+std::atomic<size_t> rf_max_depth(0);
+
+// Periodic counters from the radio loop, printed by the console thread.
+struct rf_stats {
+	uint64_t sent;
+	uint64_t frames;
+	size_t queued;
+	uint64_t dropped;
+	double airtime; // Fraction of the time since the loop started.
+	int profile; // -1 without --adaptive.
+	uint64_t switches;
+	uint64_t reports;
+	uint64_t events_sent;
+	size_t events_waiting;
+};
+
+spsc_queue<rf_stats, 4> stats_queue; // A snapshot that doesn't fit is skipped; the next one has it.
 
 // Flag for Ctrl-C.
 volatile sig_atomic_t exiting = false;
@@ -59,27 +139,97 @@ void sig_handler(int sig) {
 	exiting = true;
 }
 
-void error(uint8_t err_code, bool err_fatal, bool err_noradio, std::string err_message) {
-	if(!err_message.empty()) {
-		if(err_fatal)
-			printf("*FATAL*: %s\n", err_message);
-		else
-			printf(" ERROR : %s\n", err_message);
-	}
+// The radio's own errors and events (events.h). The console thread prints them and the radio loop
+// sends them as event frames alongside payload's.
+event_ring<EVT_RING_SIZE> events;
+event_ring<EVT_RING_SIZE>::cursor console_events; // Main thread, except while the console thread runs.
+
+// Safe from any thread: never blocks, never allocates, never touches the RF95 itself. err_message
+// must be a string literal. A fatal error ends the radio loop.
+void error(uint8_t err_code, bool err_fatal, bool err_noradio, const char* err_message, int32_t arg = 0) {
+	events.push(err_code, (err_fatal ? EVT_FATAL : 0) | (err_noradio ? EVT_NORADIO : 0), arg, err_message, st_read());
+
+	if(err_fatal)
+		exiting = true;
+}
+
+void print_events() {
+	event_record r;
+
+	while(events.read(console_events, r))
+		event_print(stdout, r);
+}
+
+// Next event frame to send: payload's first, then the radio's own.
+bool next_event(rf_packet& event, event_ring<EVT_RING_SIZE>::cursor& c) {
+	if(event_queue.pop(event))
+		return true;
+
+	event_record r;
+
+	while(events.read(c, r))
+		if(!(r.flags & EVT_NORADIO)) {
+			event_pack(r, event.data);
+			event.len = EVENT_LEN;
+			event.received = st_read();
+			return true;
+		}
+
+	return false;
+}
+
+// Low-priority console thread, the counterpart of payload's display thread: prints events and the
+// radio loop's stats snapshots so terminal I/O never runs on the SCHED_FIFO radio loop.
+void console_loop() {
+	rt_thread("console", 0, RT_CPU_BACKGROUND);
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	rf_stats st;
 
-	if(!err_noradio) {
-		char fstring[256];
-		
-		uint8_t len = strlen(fstring) + 1;
-		uint8_t* data = (uint8_t*)malloc(sizeof(uint8_t) * len);
-		strcpy((char*)data, (char*)fstring);
+	while(!exiting) {
+		print_events();
+
+		while(stats_queue.pop(st)) {
+			printf("RF: %llu packets / %llu datagrams sent, queue %zu (max %zu), %llu dropped, airtime %.1f%%, UDP %llu in / %llu rejected / %llu truncated\n",
+				(unsigned long long)st.sent, (unsigned long long)st.frames, st.queued, rf_max_depth.load(), (unsigned long long)st.dropped,
+				100.0 * st.airtime, (unsigned long long)udp_received.load(), (unsigned long long)udp_rejected.load(),
+				(unsigned long long)udp_truncated.load());
+			if(st.profile >= 0)
+				printf("RF: modem %s, %llu switches, %llu link reports\n", modem_profiles[st.profile].name,
+					(unsigned long long)st.switches, (unsigned long long)st.reports);
+			printf("RF: %llu event frames sent, %zu waiting, %llu dropped\n", (unsigned long long)st.events_sent, st.events_waiting,
+				(unsigned long long)events_dropped.load());
+		}
 
-		rf95.send(data, len);
-		rf95.waitPacketSent();
+		std::this_thread::sleep_for(std::chrono::milliseconds(RF_CONSOLE_INTERVAL_MS));
 	}
+}
 
-	if(err_fatal)
-		while(true) {}
+void set_profile(int profile) {
+	radio->set_modem(modem_profiles[profile].reg_1d, modem_profiles[profile].reg_1e, modem_profiles[profile].reg_26);
+}
+
+// Override default modem Bw, Cr, Sf, and CRC settings.
+void setup_modem() {
+	if(modem_fixed)
+		radio->set_modem(r1d, r1e, 0x04); // AGC on.
+	else
+		set_profile(MODEM_DEFAULT_PROFILE);
+}
+
+// Feeds the newest frame of a datagram to the modem selector.
+void track_altitude(modem_selector& selector, const rf_packet& packet) {
+	if(packet.len < FRAME_LEN)
+		return;
+
+	const uint8_t* frame = packet.data + (packet.len / FRAME_LEN - 1) * FRAME_LEN;
+
+	if(frame[0] != FRAME_START || frame[FRAME_LEN - 1] != FRAME_END)
+		return;
+
+	int64_t tlm[TLM_FIELD_COUNT];
+	tlm_schema::unpack(frame + 1, tlm);
+	selector.altitude(tlm[TLM_ALT]);
 }
 
 void setup_radio() {
@@ -99,20 +249,26 @@ void setup_radio() {
 	digitalWrite(RF_RST_PIN, HIGH);
 	bcm2835_delay(100);
 
+	spi0.lock();
+
 	if(!rf95.init()) {
 		fprintf(stderr, "\nERR: RF95 module initialization failed! Verify wiring?\n");
 		bcm2835_close();
 		exit(EXIT_FAILURE);
 	}
 
+	// RadioHead runs SPI at 1 MHz; the RFM95 takes up to 10.
+	rh_spi_divider = bcm2835_peri_read(bcm2835_spi0 + BCM2835_SPI0_CLK / 4);
+	bcm2835_spi_setClockDivider(RF_SPI_DIVIDER);
+
+	spi0.unlock();
+
 	// Defaults after init are 434.0MHz, 13dBm, Bw = 125 kHz, Cr = 4/5, Sf = 128chips/symbol, CRC on.
 
-	// Override default modem Bw, Cr, Sf, and CRC settings.
-	//rf95.setModemConfig(static_cast<RH_RF95::ModemConfigChoice>(modem_config));
-	//printf("Modem set to configuration #%d.\n", modem_config);
-	//RH_RF95::ModemConfig cfig = {r1d, r1e, 0x00};
-	//rf95.setModemRegisters(&cfig);
-	rf95.setModemConfig(RH_RF95::ModemConfigChoice::Bw125Cr45Sf128);
+	setup_modem(); // Takes the SPI lock itself.
+
+	spi_guard guard(spi0);
+
 	printf("Modem configuration: 0x1D = 0x%x, 0x1E = 0x%x.\n", rf95.spiRead(0x1d), rf95.spiRead(0x1e));
 
 	// The default transmitter power is 13dBm, using PA_BOOST.
@@ -156,11 +312,59 @@ void parse_args(int argc, const char* argv[]) {
 				is_prom = false;
 			}
 
-			if(!strcmp(argv[i], "--interval")) {
+			if(!strcmp(argv[i], "--realtime"))
+				realtime = true;
+
+			if(!strcmp(argv[i], "--adaptive"))
+				adaptive = true;
+
+			if(!strcmp(argv[i], "--fec"))
+				fec = true;
+
+			if(!strcmp(argv[i], "--loopback"))
+				loopback = true;
+
+			if(!strcmp(argv[i], "--ground")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					ground_ip = argv[i + 1];
+				else {
+					puts("--ground [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--range")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-' && atof(argv[i + 1]) > 0)
+					loopback_range = atof(argv[i + 1]);
+				else {
+					puts("--range [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--bench-spi")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-' && atoi(argv[i + 1]) > 0)
+					bench_spi_iterations = atoi(argv[i + 1]);
+				else {
+					puts("--bench-spi [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--loss")) {
 				if(argc > i + 1 && argv[i + 1][0] != '-')
-					tx_interval = atoi(argv[i + 1]);
+					loopback_loss = atof(argv[i + 1]) / 100;
 				else {
-					puts("--interval [i + 1] fail");
+					puts("--loss [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--batch")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					batch_ms = atoi(argv[i + 1]);
+				else {
+					puts("--batch [i + 1] fail");
 					exit(EXIT_FAILURE);
 				}
 			}
@@ -169,6 +373,7 @@ void parse_args(int argc, const char* argv[]) {
 				if(argc > i + 2 && argv[i + 1][0] != '-' && argv[i + 2][0] != '-' && strlen(argv[i + 1]) == 2 && strlen(argv[i + 2]) == 2) {
 					sscanf(argv[i + 1], "%2hhx", &r1d);
 					sscanf(argv[i + 2], "%2hhx", &r1e);
+					modem_fixed = true;
 				}
 				else {
 					puts("--modem fail");
@@ -186,55 +391,390 @@ void parse_args(int argc, const char* argv[]) {
 			}
 		}
 	}
+
+	if(modem_fixed)
+		adaptive = false;
+}
+
+void udp_receive() {
+	sock.async_receive_from(asio::buffer(udp_buffer, sizeof(udp_buffer)), udp_sender, [](const asio::error_code& ec, size_t length) {
+		if(ec == asio::error::operation_aborted)
+			return;
+
+		if(!ec) {
+			udp_received++;
+
+			if(length == EVENT_LEN && udp_buffer[0] == EVENT_START) {
+				rf_packet packet;
+
+				packet.received = st_read();
+				packet.len = length;
+				memcpy(packet.data, udp_buffer, length);
+
+				if(!event_queue.push(packet))
+					events_dropped++;
+			} else if(length >= FRAME_LEN || (length > DELTA_HEADER_LEN && udp_buffer[0] == DELTA_START)) {
+				rf_packet packet;
+
+				if(length > RH_RF95_MAX_MESSAGE_LEN) {
+					udp_truncated++;
+					error(ERR_UDP_TRUNCATED, false, false, "datagram longer than the RF95 MTU, truncated", (int32_t)length);
+					length = RH_RF95_MAX_MESSAGE_LEN;
+				}
+
+				packet.received = st_read();
+				packet.len = length;
+				memcpy(packet.data, udp_buffer, length);
+
+				rf_queue.push(packet);
+
+				size_t depth = rf_queue.size();
+				if(depth > rf_max_depth)
+					rf_max_depth = depth;
+			} else
+				udp_rejected++;
+		}
+
+		udp_receive();
+	});
+}
+
+void net_loop() {
+	rt_thread("net", RT_PRIO_NET, RT_CPU_NET);
+
+	udp_receive();
+	io_service.run();
 }
 
 void flight_loop() {
 	puts("Entering main flight loop...");
 
+	rt_thread("radio", RT_PRIO_RADIO, RT_CPU_RADIO);
+
+	latency_histogram relay_latency(1000); // UDP datagram in hand to RF TX complete.
+
+	rf_packet packet; // Being aggregated, then in flight.
+	rf_packet carry; // Popped but didn't fit in packet; goes first next time.
+	bool have_carry = false;
+	uint64_t batch_us = (uint64_t)batch_ms * 1000;
+	size_t mtu = fec ? fec_max_data(RH_RF95_MAX_MESSAGE_LEN) : RH_RF95_MAX_MESSAGE_LEN; // Data bytes per packet.
+	uint8_t coded[RH_RF95_MAX_MESSAGE_LEN];
+	uint64_t frames = 0;
+	bool tx_active = false;
+	uint64_t tx_start = 0;
+	uint64_t airtime = 0;
+	uint64_t sent = 0;
+	uint64_t dropped = 0;
+	uint64_t loop_start = st_read();
+	uint64_t stats_timer = loop_start;
+
+	// Adaptive modem state. Control packets go out on their own, ahead of any telemetry waiting.
+	modem_selector selector;
+	uint8_t ctrl[MODEM_CTRL_LEN];
+	bool tx_ctrl = false;
+	int handover_to = -1;
+	int announce_left = 0;
+	bool rx_listening = false;
+	uint64_t beacon_timer = loop_start;
+	uint64_t reports = 0;
+	uint64_t switches = 0;
+	uint64_t last_report = 0;
+	bool link_lost = false;
+
+	// Event frames share packets with telemetry but yield to it.
+	event_ring<EVT_RING_SIZE>::cursor radio_events;
+	rf_packet event;
+	uint64_t since_event = 0; // Telemetry packets since the last event went out.
+	uint64_t events_sent = 0;
+	uint64_t dropped_seen = 0;
+
+	auto start_tx = [&](const uint8_t* data, uint8_t len) {
+		radio->send(data, len);
+
+		tx_start = st_read();
+		tx_active = true;
+		rx_listening = false;
+	};
+
+	packet.len = 0;
+
 	while(!exiting) {
-		char data[1024];
-		udp::endpoint sender_endpoint;
-		size_t length = sock.receive_from(asio::buffer(data, 1024), sender_endpoint);
+		uint64_t now = st_read();
+
+		if(tx_active) {
+			if(!radio->transmitting(now)) {
+				now = st_read();
+				airtime += now - tx_start;
+				tx_active = false;
+
+				if(tx_ctrl)
+					tx_ctrl = false;
+				else {
+					relay_latency.add(now - packet.received);
+					sent++;
+					since_event++;
+					packet.len = 0;
+				}
+			}
+		}
+
+		if(!tx_active && adaptive) {
+			if(handover_to < 0) {
+				int want = selector.select(now);
+
+				if(want != selector.profile()) {
+					handover_to = want;
+					announce_left = MODEM_ANNOUNCE_COUNT;
+				} else if(now - beacon_timer > MODEM_BEACON_US) {
+					modem_switch_packet(ctrl, selector.profile(), 0);
+					start_tx(ctrl, MODEM_CTRL_LEN);
+					tx_ctrl = true;
+					beacon_timer = now;
+				}
+			}
+
+			// Announce on the old profile; retune only once the last announcement is out.
+			if(handover_to >= 0) {
+				if(announce_left > 0) {
+					modem_switch_packet(ctrl, handover_to, --announce_left);
+					start_tx(ctrl, MODEM_CTRL_LEN);
+					tx_ctrl = true;
+				} else {
+					set_profile(handover_to);
+					selector.switched(handover_to, now);
+					events.push(EVT_MODEM_PROFILE, EVT_INFO, handover_to, modem_profiles[handover_to].name, now);
+					handover_to = -1;
+					beacon_timer = now;
+					switches++;
+				}
+			}
+		}
+
+		if(!tx_active) {
+			// Aggregation: concatenate whole datagrams (each one or more 0x5e...0xd5 frames) into one
+			// radio packet so the preamble and header are paid once. Frames that arrive during airtime
+			// pile up in rf_queue and all go out together in the next packet.
+			bool full = false;
+
+			// Events go out when telemetry leaves room for them: on an empty queue, or every
+			// RF_EVENT_INTERVAL packets so a saturated link can't starve them.
+			if(packet.len == 0 && !have_carry && (rf_queue.size() == 0 || since_event >= RF_EVENT_INTERVAL) && next_event(event, radio_events)) {
+				memcpy(packet.data, event.data, event.len);
+				packet.len = event.len;
+				packet.received = event.received;
+				since_event = 0;
+				events_sent++;
+			}
+
+			while(!full && (have_carry || rf_queue.pop(carry, dropped))) {
+				have_carry = true;
+
+				if(packet.len > 0 && (batch_us == 0 || packet.len + carry.len > mtu)) {
+					full = true;
+					break;
+				}
+
+				// Only possible with --fec, whose parity eats into the MTU.
+				if(carry.len > mtu) {
+					carry.len = mtu;
+					udp_truncated++;
+				}
+
+				if(packet.len == 0)
+					packet.received = carry.received;
+
+				if(adaptive)
+					track_altitude(selector, carry);
+
+				memcpy(packet.data + packet.len, carry.data, carry.len);
+				packet.len += carry.len;
+				frames++;
+				have_carry = false;
+			}
+
+			if(dropped != dropped_seen) {
+				error(ERR_RF_QUEUE_DROPPED, false, false, "RF queue full, dropped the oldest datagram", (int32_t)dropped);
+				dropped_seen = dropped;
+			}
+
+			// received is stamped on the net thread and can be a hair newer than now.
+			if(packet.len > 0 && (full || (int64_t)(now - packet.received) >= (int64_t)batch_us)) {
+				if(fec)
+					start_tx(coded, fec_encode(packet.data, packet.len, coded));
+				else
+					start_tx(packet.data, packet.len);
+			}
+		}
+
+		// Between transmissions, listen for link reports from the ground.
+		if(!tx_active && adaptive) {
+			if(!rx_listening) {
+				radio->listen();
+				rx_listening = true;
+			}
+
+			uint8_t report[RH_RF95_MAX_MESSAGE_LEN];
+			uint8_t len = sizeof(report);
+			int rssi;
+			float snr;
 
-		std::cout << "Received UDP packet. Length " << length << ", data: " std::hex << data << std::endl;
+			if(radio->receive(report, len) && modem_parse_report(report, len, rssi, snr)) {
+				selector.link_report(snr, now);
+				reports++;
+				last_report = now;
+				link_lost = false;
+			}
 
-		if(false /* TODO: check for 1st byte magic word */) {
-			// do comms parse
-		} else if(length >= 18) {
-			rf95.send(data, len);
-			rf95.waitPacketSent();
+			if(last_report && !link_lost && now - last_report > MODEM_REPORT_TIMEOUT_US) {
+				error(ERR_LINK_LOST, false, false, "no link reports from the ground, back to the default profile");
+				link_lost = true;
+			}
+		}
+
+		if(now - stats_timer > RF_STATS_INTERVAL_US) {
+			rf_stats st;
+
+			st.sent = sent;
+			st.frames = frames;
+			st.queued = rf_queue.size();
+			st.dropped = dropped;
+			st.airtime = (double)airtime / (now - loop_start);
+			st.profile = adaptive ? selector.profile() : -1;
+			st.switches = switches;
+			st.reports = reports;
+			st.events_sent = events_sent;
+			st.events_waiting = event_queue.size();
+
+			stats_queue.push(st);
+			stats_timer = now;
+		}
+
+		// Nothing to do until the IRQ edge, the next datagram or the batch deadline; yield the core briefly.
+		if(tx_active || (rf_queue.size() == 0 && event_queue.size() == 0)) {
+			struct timespec ts = {0, 200000};
+			nanosleep(&ts, NULL);
 		}
 	}
 
 	puts("Exiting main flight loop... (wtf?!)");
+	printf("RF: %llu sent, %llu dropped, airtime %.1f%%\n", (unsigned long long)sent, (unsigned long long)dropped,
+		100.0 * airtime / (st_read() - loop_start));
+	relay_latency.print("UDP to RF TX complete");
+	radio->print_stats();
+}
+
+// --bench-spi: loads the FIFO iterations times for each packet size, way and SPI clock, with the
+// RF95 in standby, so nothing goes on air.
+void bench_spi(rf95_driver& driver, int iterations) {
+	const uint32_t dividers[] = {rh_spi_divider, RF_SPI_DIVIDER};
+	const uint8_t sizes[] = {FRAME_LEN, RH_RF95_MAX_MESSAGE_LEN};
+	uint8_t data[RH_RF95_MAX_MESSAGE_LEN];
+
+	for(size_t i = 0; i < sizeof(data); i++)
+		data[i] = i;
+
+	{
+		spi_guard guard(spi0);
+		rf95.setModeIdle();
+	}
+
+	printf("RF95 FIFO load, %d iterations:\n", iterations);
+
+	for(uint32_t divider : dividers)
+		for(uint8_t len : sizes)
+			for(int burst = 0; burst < 2; burst++) {
+				uint64_t total = 0;
+				uint64_t worst = 0;
+
+				for(int i = 0; i < iterations; i++) {
+					spi_guard guard(spi0);
+					bcm2835_spi_setClockDivider(divider);
+
+					uint64_t start = st_read();
+					if(burst)
+						driver.load_fifo(data, len);
+					else
+						driver.load_fifo_radiohead(data, len);
+
+					uint64_t us = st_read() - start;
+					total += us;
+					worst = us > worst ? us : worst;
+				}
+
+				printf("  SPI /%-4u %3u bytes  %-9s  %8.1f us mean  %6llu us max\n", divider, len, burst ? "burst" : "RadioHead",
+					(double)total / iterations, (unsigned long long)worst);
+			}
+
+	spi_guard guard(spi0);
+	bcm2835_spi_setClockDivider(RF_SPI_DIVIDER);
 }
 
 int main(int argc, const char* argv[]) {
 	signal(SIGINT, sig_handler);
-	setvbuf(stdout, NULL, _IONBF, 0);
+	setvbuf(stdout, NULL, _IOLBF, 0);
 
 	puts("\nSEDS-UCF - IREC 2018 - Telemetry and Experiment Control System (TECS v0.0)\n");
 
 	parse_args(argc, argv);
 
-	if(!bcm2835_init()) {
-		error(ERR_BCM_INIT_FAIL, false, false, "bcm2835 init failure");
-		exit(EXIT_FAILURE);
+	if(loopback) {
+		loopback_driver* channel = new loopback_driver(tx_power, loopback_range, loopback_loss);
+
+		if(!channel->open(ground_ip, GROUND_PORT)) {
+			printf("Loopback: bad ground address %s\n", ground_ip.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		st_simulated = true;
+		radio = channel;
+		setup_modem();
+		printf("Loopback radio: sending to %s:%d, ground station %.0f m away.\n", ground_ip.c_str(), GROUND_PORT, loopback_range);
+	} else {
+		if(!bcm2835_init()) {
+			error(ERR_BCM_INIT_FAIL, false, false, "bcm2835 init failure");
+			print_events();
+			exit(EXIT_FAILURE);
+		}
+
+		rf95_driver* driver = new rf95_driver(rf95, RF_IRQ_PIN, RF_CS_PIN, spi0, RF_GROUND_ID, RF_FLIGHT_ID);
+
+		radio = driver;
+		setup_radio();
+
+		if(bench_spi_iterations > 0) {
+			bench_spi(*driver, bench_spi_iterations);
+			bcm2835_close();
+			return EXIT_SUCCESS;
+		}
 	}
 
-	setup_radio();
+	sock.open(udp::v4());
+	sock.bind(udp::endpoint(udp::v4(), NETWORK_PORT));
+
+	if(realtime && rt_lock_memory())
+		puts("Realtime mode: memory locked.");
 
-	sock = udp::socket(io_service, udp::endpoint(udp::v4(), NETWORK_PORT));
+	std::thread console_thread(console_loop);
+	std::thread net_thread(net_loop);
 
 	flight_loop();
 
+	io_service.stop();
+	net_thread.join();
+	console_thread.join();
+
+	print_events();
+	printf("Events: %llu raised, %llu suppressed as repeats.\n", (unsigned long long)events.pushed(), (unsigned long long)events.suppressed());
+
 	// We should never reach this point in flight conditions.
 	// Expect direct shutdown of the Raspberry Pi, with no gracefulness.
 
 	puts("WARN: broke loop! ground test?");
 
-	puts("Closing bcm2835 hook...\n");
-	bcm2835_close();
+	if(!loopback) {
+		puts("Closing bcm2835 hook...\n");
+		bcm2835_close();
+	}
 
 	puts("Good bye!\n");
 	return EXIT_SUCCESS;
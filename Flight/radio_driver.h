@@ -0,0 +1,360 @@
+#ifndef RADIO_DRIVER_H
+#define RADIO_DRIVER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include <random>
+#include <string>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <bcm2835.h>
+#include <RH_RF95.h>
+
+#include "histogram.h"
+#include "modem.h"
+#include "spi_lock.h"
+#include "telemetry.h"
+#include "timebase.h"
+
+// What radio.cpp's loop transmits through.
+//
+// rf95_driver is the RFM95 on SPI: send() loads the FIFO and starts TX, and completion comes from
+// the DIO0 interrupt edge on irq_pin (bcm2835_gpio_eds), with an SPI poll of the IRQ flags every
+// RF_IRQ_FALLBACK_US in case the edge was missed. SPI0 is shared with payload's battery ADC, so
+// everything that talks to the RF95 holds spi_lock (spi_lock.h).
+//
+// RH_RF95::send() loads the FIFO in six chip select cycles with a bcm2835_spi_transfer() per
+// byte, each of which starts and stops the SPI controller. send() here writes the same registers
+// itself: the FIFO pointer, then the RadioHead header and the whole packet as one
+// bcm2835_spi_writenb() burst (the FIFO register doesn't auto-increment, so every byte lands in
+// the FIFO), then the payload length. RadioHead still does the mode changes, so its idea of the
+// mode stays right for handleInterrupt(). load_time() has how long each load took; radio
+// --bench-spi compares the two on the bench.
+//
+// loopback_driver needs no hardware. It keeps the RF95's timing by holding each packet for its
+// LoRa time on air, computed from the current modem registers, then runs it through a channel
+// model and sends whatever the ground station would have demodulated to a UDP port, where
+// tecs-recv decodes it as if it came from irec2018_gr.py. The channel model:
+//   - distance is the ground range plus the altitude in the newest telemetry frame on board;
+//   - RSSI from free-space path loss at RF_FREQUENCY plus LOOPBACK_EXCESS_LOSS, SNR against the
+//     thermal noise in the modem bandwidth plus LOOPBACK_NOISE_FIGURE, with LOOPBACK_FADING dB of
+//     Gaussian fading;
+//   - below the spreading factor's demodulation floor the packet is lost; within
+//     LOOPBACK_ERROR_MARGIN dB above it, bytes are corrupted at a rate rising towards the floor
+//     (what --fec is for); on top of that, a fixed random loss rate.
+// The simulated ground station answers with a link report every LOOPBACK_REPORT_US, so
+// --adaptive runs the same as against a real ground station.
+
+#define RF_IRQ_FALLBACK_US 5000 // Poll the IRQ flags over SPI this often in case the DIO0 edge was missed.
+#define RF_SPI_DIVIDER 40 // 6.25 MHz on a 250 MHz core clock, 10 MHz on 400 MHz: the RFM95's limit. Even, not a power of two; see the BCM2835 errata.
+
+#define LOOPBACK_FREQUENCY 915e6 // Hz, RF_FREQUENCY.
+#define LOOPBACK_RANGE 2000.0 // m, horizontal distance to the ground station.
+#define LOOPBACK_NOISE_FIGURE 6.0 // dB, receiver.
+#define LOOPBACK_ANTENNA_GAIN 6.0 // dBi, both antennas together.
+#define LOOPBACK_EXCESS_LOSS 30.0 // dB beyond free space: antenna nulls, the airframe, the ground.
+#define LOOPBACK_FADING 2.0 // dB, 1-sigma.
+#define LOOPBACK_ERROR_MARGIN 3.0 // dB above the demodulation floor where byte errors start.
+#define LOOPBACK_ERROR_RATE 0.02 // Byte error probability at the floor.
+#define LOOPBACK_REPORT_US 1000000
+
+class radio_driver {
+public:
+	virtual ~radio_driver() {}
+
+	virtual void set_modem(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26) = 0;
+
+	// Starts transmitting and returns without waiting for it to finish.
+	virtual void send(const uint8_t* data, uint8_t len) = 0;
+
+	// False once the packet from send() has left the antenna.
+	virtual bool transmitting(uint64_t now) = 0;
+
+	// Switches to receive between transmissions.
+	virtual void listen() = 0;
+
+	// Fetches a received packet if there is one. len holds the buffer size on entry.
+	virtual bool receive(uint8_t* data, uint8_t& len) = 0;
+
+	virtual void print_stats() {}
+};
+
+class rf95_driver : public radio_driver {
+public:
+	// to and from are the RadioHead header addresses, as RH_RF95::setHeaderTo()/setHeaderFrom().
+	rf95_driver(RH_RF95& rf95, uint8_t irq_pin, uint8_t cs_pin, spi_lock& bus, uint8_t to, uint8_t from) : rf95(rf95), pin(irq_pin),
+		cs(cs_pin), bus(bus), header_to(to), header_from(from), polled(0), load(5) {}
+
+	void set_modem(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26) {
+		RH_RF95::ModemConfig config = {reg_1d, reg_1e, reg_26};
+		spi_guard guard(bus);
+
+		rf95.setModemRegisters(&config);
+	}
+
+	void send(const uint8_t* data, uint8_t len) {
+		bcm2835_gpio_set_eds(pin);
+
+		// The RF95 is idle (or listening), so this loads the FIFO and starts TX without waiting.
+		spi_guard guard(bus);
+
+		rf95.setModeIdle();
+
+		uint64_t start = st_read();
+		load_fifo(data, len);
+		polled = st_read();
+		load.add(polled - start);
+
+		rf95.setModeTx();
+	}
+
+	// The FIFO load as above, in one burst.
+	void load_fifo(const uint8_t* data, uint8_t len) {
+		len = len > RH_RF95_MAX_MESSAGE_LEN ? RH_RF95_MAX_MESSAGE_LEN : len;
+
+		write_register(RH_RF95_REG_0D_FIFO_ADDR_PTR, 0);
+
+		burst[0] = RH_RF95_REG_00_FIFO | RH_RF95_SPI_WRITE_MASK;
+		burst[1] = header_to;
+		burst[2] = header_from;
+		burst[3] = 0; // Id
+		burst[4] = 0; // Flags
+		memcpy(burst + 1 + RH_RF95_HEADER_LEN, data, len);
+		transfer(burst, 1 + RH_RF95_HEADER_LEN + len);
+
+		write_register(RH_RF95_REG_22_PAYLOAD_LENGTH, len + RH_RF95_HEADER_LEN);
+	}
+
+	// The same load the way RH_RF95::send() does it, for --bench-spi.
+	void load_fifo_radiohead(const uint8_t* data, uint8_t len) {
+		rf95.spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, 0);
+		rf95.spiWrite(RH_RF95_REG_00_FIFO, header_to);
+		rf95.spiWrite(RH_RF95_REG_00_FIFO, header_from);
+		rf95.spiWrite(RH_RF95_REG_00_FIFO, 0);
+		rf95.spiWrite(RH_RF95_REG_00_FIFO, 0);
+		rf95.spiBurstWrite(RH_RF95_REG_00_FIFO, data, len);
+		rf95.spiWrite(RH_RF95_REG_22_PAYLOAD_LENGTH, len + RH_RF95_HEADER_LEN);
+	}
+
+	const latency_histogram& load_time() const { return load; }
+
+	bool transmitting(uint64_t now) {
+		if(bcm2835_gpio_eds(pin)) {
+			bcm2835_gpio_set_eds(pin);
+			spi_guard guard(bus);
+			rf95.handleInterrupt();
+		} else if(now - polled > RF_IRQ_FALLBACK_US) {
+			spi_guard guard(bus);
+			rf95.handleInterrupt();
+			polled = now;
+		}
+
+		return rf95.mode() == RHGenericDriver::RHModeTx;
+	}
+
+	void listen() {
+		bcm2835_gpio_set_eds(pin);
+		spi_guard guard(bus);
+		rf95.setModeRx();
+	}
+
+	bool receive(uint8_t* data, uint8_t& len) {
+		// Once handleInterrupt() has taken a packet RadioHead drops to idle, and available() puts
+		// the RF95 back in RX over SPI, so the whole read holds the bus.
+		spi_guard guard(bus);
+
+		if(bcm2835_gpio_eds(pin)) {
+			bcm2835_gpio_set_eds(pin);
+			rf95.handleInterrupt();
+		}
+
+		return rf95.available() && rf95.recv(data, &len);
+	}
+
+	void print_stats() {
+		load.print("RF95 FIFO load");
+	}
+
+private:
+	void write_register(uint8_t reg, uint8_t value) {
+		char buf[2] = {(char)(reg | RH_RF95_SPI_WRITE_MASK), (char)value};
+		transfer(buf, sizeof(buf));
+	}
+
+	// One chip select cycle. RadioHead drives the RF95's chip select as a GPIO, not through the SPI
+	// controller.
+	void transfer(char* buf, uint32_t len) {
+		bcm2835_gpio_write(cs, LOW);
+		bcm2835_spi_writenb(buf, len);
+		bcm2835_gpio_write(cs, HIGH);
+	}
+
+	RH_RF95& rf95;
+	uint8_t pin;
+	uint8_t cs;
+	spi_lock& bus;
+	uint8_t header_to;
+	uint8_t header_from;
+	uint64_t polled;
+	latency_histogram load;
+	char burst[1 + RH_RF95_HEADER_LEN + RH_RF95_MAX_MESSAGE_LEN];
+};
+
+class loopback_driver : public radio_driver {
+public:
+	loopback_driver(int tx_power, double range_m, double loss) : power(tx_power), range(range_m), loss_rate(loss), fd(-1), rng(1963),
+		uniform(0, 1), fading(0, LOOPBACK_FADING), active(false), tx_end(0), len(0), altitude(0),
+		report_pending(false), last_report(0), rssi(0), snr(0), delivered(0), lost(0), corrupted(0), bytes_corrupted(0), send_errors(0) {
+		set_modem(0x72, 0x74, 0x04);
+	}
+
+	~loopback_driver() {
+		if(fd >= 0)
+			close(fd);
+	}
+
+	// Where the ground station's packets go, normally tecs-recv on GROUND_PORT.
+	bool open(const std::string& host, int port) {
+		memset(&dest, 0, sizeof(dest));
+		dest.sin_family = AF_INET;
+		dest.sin_port = htons(port);
+
+		if(inet_pton(AF_INET, host.c_str(), &dest.sin_addr) != 1)
+			return false;
+
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		return fd >= 0;
+	}
+
+	void set_modem(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26) {
+		modem = modem_decode(reg_1d, reg_1e, reg_26);
+	}
+
+	void send(const uint8_t* data, uint8_t n) {
+		memcpy(air, data, n);
+		len = n;
+		tx_end = st_read() + modem_airtime_us(modem, n);
+		active = true;
+	}
+
+	bool transmitting(uint64_t now) {
+		if(active && now >= tx_end) {
+			active = false;
+			deliver(now);
+		}
+
+		return active;
+	}
+
+	void listen() {}
+
+	bool receive(uint8_t* data, uint8_t& n) {
+		if(!report_pending || n < MODEM_CTRL_LEN)
+			return false;
+
+		modem_report_packet(data, (int)lround(rssi), snr);
+		n = MODEM_CTRL_LEN;
+		report_pending = false;
+		return true;
+	}
+
+	void print_stats() {
+		printf("Loopback channel: %llu delivered (%llu with %llu corrupted bytes), %llu lost, %llu send errors, last RSSI %.0f dBm, SNR %.1f dB\n",
+			(unsigned long long)delivered, (unsigned long long)corrupted, (unsigned long long)bytes_corrupted, (unsigned long long)lost,
+			(unsigned long long)send_errors, rssi, snr);
+	}
+
+private:
+	void deliver(uint64_t now) {
+		track_altitude();
+
+		double distance = sqrt(range * range + altitude * altitude);
+		double path_loss = 20 * log10(distance) + 20 * log10(LOOPBACK_FREQUENCY) - 147.55; // Free space, m and Hz.
+		double noise = -174 + 10 * log10(modem.bw) + LOOPBACK_NOISE_FIGURE; // dBm
+		double limit = -7.5 - 2.5 * ((int)modem.sf - 7); // Demodulation floor, dB.
+
+		rssi = power + LOOPBACK_ANTENNA_GAIN - path_loss - LOOPBACK_EXCESS_LOSS;
+		snr = rssi - noise + fading(rng);
+
+		if(snr < limit || uniform(rng) < loss_rate) {
+			lost++;
+			return;
+		}
+
+		if(snr < limit + LOOPBACK_ERROR_MARGIN) {
+			double p = LOOPBACK_ERROR_RATE * pow(10, (limit - snr) / LOOPBACK_ERROR_MARGIN);
+			size_t errors = 0;
+
+			for(size_t i = 0; i < len; i++)
+				if(uniform(rng) < p) {
+					air[i] ^= 1 + (uint8_t)(uniform(rng) * 255);
+					errors++;
+				}
+
+			bytes_corrupted += errors;
+			corrupted += errors > 0;
+		}
+
+		if(sendto(fd, air, len, MSG_DONTWAIT, (const struct sockaddr*)&dest, sizeof(dest)) != (ssize_t)len)
+			send_errors++;
+
+		delivered++;
+
+		if(now - last_report > LOOPBACK_REPORT_US) {
+			report_pending = true;
+			last_report = now;
+		}
+	}
+
+	// Altitude above the pad from the newest telemetry frame in the packet.
+	void track_altitude() {
+		for(size_t i = len >= FRAME_LEN ? len - FRAME_LEN + 1 : 0; i-- > 0;) {
+			if(air[i] != FRAME_START || air[i + FRAME_LEN - 1] != FRAME_END)
+				continue;
+
+			int64_t tlm[TLM_FIELD_COUNT];
+			tlm_schema::unpack(air + i + 1, tlm);
+
+			altitude = tlm[TLM_ALT];
+			return;
+		}
+	}
+
+	int power; // dBm
+	double range;
+	double loss_rate;
+	int fd;
+	struct sockaddr_in dest;
+	modem_params modem;
+
+	std::mt19937 rng;
+	std::uniform_real_distribution<double> uniform;
+	std::normal_distribution<double> fading;
+
+	bool active;
+	uint64_t tx_end;
+	uint8_t air[256];
+	size_t len;
+
+	double altitude;
+
+	bool report_pending;
+	uint64_t last_report;
+	double rssi, snr;
+
+	uint64_t delivered;
+	uint64_t lost;
+	uint64_t corrupted;
+	uint64_t bytes_corrupted;
+	uint64_t send_errors;
+};
+
+#endif //RADIO_DRIVER_H
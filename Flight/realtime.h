@@ -0,0 +1,91 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// --realtime support shared by payload and radio.
+//
+// rt_lock_memory() pins every current and future page so a page fault can never land in the
+// middle of a sensor read or a radio transmission. Each thread then calls rt_thread() for itself
+// with its SCHED_FIFO priority (0 keeps it SCHED_OTHER) and the core it should live on, and
+// prefaults its own stack. All of it needs root (or CAP_SYS_NICE/CAP_IPC_LOCK); failures are
+// reported and otherwise ignored so a bench run without privileges still works.
+
+#define RT_STACK_PREFAULT (256 * 1024)
+#define RT_NO_CPU -1
+
+// Per-thread priorities and cores. The Pi 3 has four cores. The acquisition threads spin on the
+// system timer for the last stretch before every deadline, so each gets a core to itself (3 and 2).
+// Radio's TX loop and the UDP threads of both processes share core 1: they sleep between packets,
+// and radio's priority puts it ahead of a net thread that wakes at the same time. Core 0 keeps the
+// kernel housekeeping and the SCHED_OTHER threads (display, black box, flight log, battery).
+#define RT_PRIO_ACQ_MAIN 80
+#define RT_PRIO_ACQ_AUX 79
+#define RT_PRIO_RADIO 70
+#define RT_PRIO_NET 60
+
+#define RT_CPU_ACQ_MAIN 3
+#define RT_CPU_ACQ_AUX 2
+#define RT_CPU_RADIO 1
+#define RT_CPU_NET 1
+#define RT_CPU_BACKGROUND 0
+
+bool realtime = false; // Set by --realtime.
+
+bool rt_lock_memory() {
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		printf(" ERROR : mlockall failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+// Touches the next `size` bytes of this thread's stack so it's resident before the loop starts.
+void rt_prefault_stack(size_t size = RT_STACK_PREFAULT) {
+	volatile unsigned char stack[RT_STACK_PREFAULT];
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if(size > sizeof(stack))
+		size = sizeof(stack);
+
+	for(size_t i = 0; i < size; i += page)
+		stack[i] = 0;
+}
+
+// Applies the realtime policy for the calling thread. No-op unless --realtime was given.
+void rt_thread(const char* name, int priority, int cpu) {
+	if(!realtime)
+		return;
+
+	if(cpu != RT_NO_CPU) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if(err)
+			printf(" ERROR : %s: pinning to CPU %d failed: %s\n", name, cpu, strerror(err));
+	}
+
+	if(priority > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if(err)
+			printf(" ERROR : %s: SCHED_FIFO %d failed: %s\n", name, priority, strerror(err));
+	}
+
+	rt_prefault_stack();
+}
+
+#endif //REALTIME_H
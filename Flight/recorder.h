@@ -0,0 +1,417 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "spsc.h"
+#include "realtime.h"
+
+// Onboard black-box flight recorder.
+//
+// Every sensor sample is appended to SD as a fixed 64-byte bb_record. Records are grouped into
+// 4 KiB blocks with a CRC-32 per block, and blocks are written into preallocated segment files
+// (bb_0000.bin, bb_0001.bin, ...). The sensor threads only push into per-source SPSC queues; all
+// file I/O, including the batched fdatasync, happens on the recorder's own thread, so a slow card
+// costs dropped records (counted) rather than a stalled sample loop.
+//
+// Each run records into a new numbered directory under the one given (blackbox/0000/,
+// blackbox/0001/, ...), and segments are never opened with O_TRUNC, so a payload restarted
+// mid-flight by a brownout or the watchdog starts a new run beside the old one and can't touch it.
+
+#define BB_MAGIC 0x52424254 // "TBBR", little-endian on disk.
+#define BB_VERSION 1
+#define BB_BLOCK_SIZE 4096
+#define BB_SEGMENT_BLOCKS 4096 // 16 MiB per segment.
+#define BB_SYNC_BLOCKS 16 // fdatasync after this many blocks.
+#define BB_FLUSH_MS 250 // Write out a partially filled block after this long.
+#define BB_QUEUE_SIZE 1024 // Per source.
+
+enum bb_source {
+	BB_MPU_MAIN = 0,
+	BB_MPU_AUX,
+	BB_BARO,
+	BB_SOURCE_COUNT
+};
+
+// bb_record.valid bits.
+#define BB_VALID_ACCEL 0x01
+#define BB_VALID_GYRO 0x02
+#define BB_VALID_COMPASS 0x04
+#define BB_VALID_POSE 0x08
+#define BB_VALID_PRESSURE 0x10
+#define BB_VALID_TEMP 0x20
+
+struct bb_record {
+	uint64_t timestamp; // us
+	uint8_t source; // bb_source
+	uint8_t valid; // BB_VALID_* bits
+	int16_t temperature; // 0.01 C
+	float accel[3]; // g
+	float gyro[3]; // deg/s
+	float compass[3]; // uT
+	float pose[3]; // roll, pitch, yaw in deg
+	float pressure; // hPa
+};
+
+static_assert(sizeof(bb_record) == 64, "bb_record must stay 64 bytes");
+
+struct bb_block_header {
+	uint32_t magic;
+	uint32_t seq; // Block number since the recorder started, across segments.
+	uint16_t count; // Records in this block.
+	uint8_t version;
+	uint8_t reserved;
+	uint32_t crc; // CRC-32 of the header (with crc = 0) and the used records.
+};
+
+#define BB_BLOCK_RECORDS ((BB_BLOCK_SIZE - sizeof(bb_block_header)) / sizeof(bb_record))
+
+static_assert(sizeof(bb_block_header) == 16, "bb_block_header must stay 16 bytes");
+
+static inline uint32_t bb_block_crc(const uint8_t* block) {
+	bb_block_header h;
+	memcpy(&h, block, sizeof(h));
+
+	h.crc = 0;
+
+	uint32_t crc = crc32((const uint8_t*)&h, sizeof(h));
+	crc = crc32(block + sizeof(h), h.count * sizeof(bb_record), crc);
+
+	return crc;
+}
+
+// True if block holds an intact recorder block. Use when reading segments back.
+static inline bool bb_block_valid(const uint8_t* block) {
+	bb_block_header h;
+	memcpy(&h, block, sizeof(h));
+
+	return h.magic == BB_MAGIC && h.count <= BB_BLOCK_RECORDS && bb_block_crc(block) == h.crc;
+}
+
+// Reads a recording back, segment by segment: every intact record from the sources in source_mask
+// (1 << bb_source bits), in the order it was written, which for any one source is time order.
+// Blocks that fail their CRC and the zeroed tail of the last segment are skipped. Block seq numbers
+// must follow on across those skips; the recording ends at the first intact block that doesn't, so
+// segments left over from some other recording are never played as part of this one.
+class bb_reader {
+public:
+	bb_reader() : fd(-1), segment(0), sources(0), pos(0), count(0), expected(0), ended(false) {}
+	~bb_reader() {
+		if(fd >= 0)
+			close(fd);
+	}
+
+	bool open(const std::string& dir, unsigned source_mask) {
+		path = dir;
+		sources = source_mask;
+		segment = 0;
+		pos = count = 0;
+		expected = 0;
+		ended = false;
+
+		return open_segment();
+	}
+
+	// False at the end of the recording.
+	bool next(bb_record& r) {
+		while(true) {
+			while(pos < count) {
+				memcpy(&r, block + sizeof(bb_block_header) + pos++ * sizeof(bb_record), sizeof(r));
+
+				if(r.source < BB_SOURCE_COUNT && (sources >> r.source & 1))
+					return true;
+			}
+
+			if(fd < 0 || ended)
+				return false;
+
+			if(read(fd, block, BB_BLOCK_SIZE) == BB_BLOCK_SIZE) {
+				bb_block_header h;
+				memcpy(&h, block, sizeof(h));
+
+				pos = count = 0;
+
+				// A bad block still took a seq number when it was written.
+				if(!bb_block_valid(block)) {
+					expected++;
+					continue;
+				}
+
+				if(h.seq != expected) {
+					ended = true;
+					return false;
+				}
+
+				count = h.count;
+				expected++;
+				continue;
+			}
+
+			close(fd);
+			segment++;
+
+			if(!open_segment())
+				return false;
+		}
+	}
+
+private:
+	bool open_segment() {
+		char name[32];
+		snprintf(name, sizeof(name), "/bb_%04u.bin", segment);
+
+		fd = ::open((path + name).c_str(), O_RDONLY);
+		return fd >= 0;
+	}
+
+	std::string path;
+	int fd;
+	unsigned segment;
+	unsigned sources;
+	size_t pos;
+	size_t count;
+	uint32_t expected; // seq of the next block.
+	bool ended;
+	uint8_t block[BB_BLOCK_SIZE];
+};
+
+class blackbox {
+public:
+	blackbox() : fd(-1), segment(0), segment_block(0), block_seq(0), blocks_unsynced(0), block(NULL), used(0), direct(false), running(false),
+	             written(0), blocks(0), syncs(0), write_errors(0) {
+		for(size_t i = 0; i < BB_SOURCE_COUNT; i++)
+			dropped[i] = 0;
+	}
+
+	// Creates dir if needed, and in it the next free run directory, and preallocates the first
+	// segment there. Call before the flight loop.
+	bool open(const std::string& dir, bool use_direct) {
+		direct = use_direct;
+
+		mkdir(dir.c_str(), 0755);
+
+		for(unsigned run = 0;; run++) {
+			char name[32];
+			snprintf(name, sizeof(name), "/%04u", run);
+
+			path = dir + name;
+
+			if(mkdir(path.c_str(), 0755) == 0)
+				break;
+
+			if(errno != EEXIST || run == 9999)
+				return false;
+		}
+
+		if(posix_memalign((void**)&block, BB_BLOCK_SIZE, BB_BLOCK_SIZE) != 0)
+			return false;
+
+		memset(block, 0, BB_BLOCK_SIZE);
+
+		return open_segment();
+	}
+
+	// Producer side, one thread per source. Never blocks; returns false and counts a drop when full.
+	bool record(const bb_record& r) {
+		if(queues[r.source].push(r))
+			return true;
+
+		dropped[r.source]++;
+		return false;
+	}
+
+	void start() {
+		running = true;
+		writer = std::thread(&blackbox::run, this);
+	}
+
+	// Drains the queues, writes the last partial block, syncs and closes.
+	void stop() {
+		running = false;
+
+		if(writer.joinable())
+			writer.join();
+
+		if(fd >= 0) {
+			fdatasync(fd);
+			close(fd);
+			fd = -1;
+		}
+
+		free(block);
+		block = NULL;
+	}
+
+	uint64_t records_written() const { return written; }
+	uint64_t records_dropped() const {
+		uint64_t n = 0;
+		for(size_t i = 0; i < BB_SOURCE_COUNT; i++)
+			n += dropped[i];
+		return n;
+	}
+	uint64_t blocks_written() const { return blocks; }
+	uint64_t errors() const { return write_errors; }
+
+	// This run's directory, once open.
+	const std::string& directory() const { return path; }
+
+private:
+	void run() {
+		// Recording must never starve the sensor threads.
+		rt_thread("blackbox", 0, RT_CPU_BACKGROUND);
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+
+		std::chrono::steady_clock::time_point last_flush = std::chrono::steady_clock::now();
+
+		while(true) {
+			bool stopping = !running;
+			size_t drained = 0;
+			bb_record r;
+
+			for(size_t i = 0; i < BB_SOURCE_COUNT; i++)
+				while(queues[i].pop(r)) {
+					append(r);
+					drained++;
+				}
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			if(used > 0 && (stopping || now - last_flush > std::chrono::milliseconds(BB_FLUSH_MS))) {
+				write_block();
+				last_flush = now;
+			}
+
+			if(stopping)
+				break;
+
+			if(drained == 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		}
+	}
+
+	void append(const bb_record& r) {
+		memcpy(block + sizeof(bb_block_header) + used * sizeof(bb_record), &r, sizeof(r));
+		used++;
+
+		if(used == BB_BLOCK_RECORDS)
+			write_block();
+	}
+
+	void write_block() {
+		if(fd < 0 && !open_segment()) {
+			write_errors++;
+			used = 0;
+			return;
+		}
+
+		// Zero the unused tail so stale records from the previous block never reach the card.
+		memset(block + sizeof(bb_block_header) + used * sizeof(bb_record), 0,
+		       BB_BLOCK_SIZE - sizeof(bb_block_header) - used * sizeof(bb_record));
+
+		bb_block_header h;
+		h.magic = BB_MAGIC;
+		h.seq = block_seq;
+		h.count = (uint16_t)used;
+		h.version = BB_VERSION;
+		h.reserved = 0;
+		h.crc = 0;
+		memcpy(block, &h, sizeof(h));
+
+		h.crc = bb_block_crc(block);
+		memcpy(block, &h, sizeof(h));
+
+		if(pwrite(fd, block, BB_BLOCK_SIZE, (off_t)segment_block * BB_BLOCK_SIZE) != BB_BLOCK_SIZE)
+			write_errors++;
+		else {
+			written += used;
+			blocks++;
+		}
+
+		block_seq++;
+		segment_block++;
+		used = 0;
+
+		if(++blocks_unsynced >= BB_SYNC_BLOCKS) {
+			fdatasync(fd);
+			syncs++;
+			blocks_unsynced = 0;
+		}
+
+		if(segment_block == BB_SEGMENT_BLOCKS) {
+			fdatasync(fd);
+			close(fd);
+			fd = -1;
+			segment++;
+			open_segment();
+		}
+	}
+
+	bool open_segment() {
+		char name[32];
+		snprintf(name, sizeof(name), "/bb_%04u.bin", segment);
+
+		std::string file = path + name;
+		int flags = O_WRONLY | O_CREAT;
+
+		fd = -1;
+
+#ifdef O_DIRECT
+		if(direct)
+			fd = ::open(file.c_str(), flags | O_DIRECT, 0644);
+#endif
+
+		// Not every filesystem takes O_DIRECT; fall back to the page cache rather than not recording.
+		if(fd < 0)
+			fd = ::open(file.c_str(), flags, 0644);
+
+		if(fd < 0)
+			return false;
+
+		// Reserve the whole segment up front so the card never has to allocate mid-flight.
+		posix_fallocate(fd, 0, (off_t)BB_SEGMENT_BLOCKS * BB_BLOCK_SIZE);
+
+		segment_block = 0;
+		blocks_unsynced = 0;
+		return true;
+	}
+
+	spsc_queue<bb_record, BB_QUEUE_SIZE> queues[BB_SOURCE_COUNT];
+	std::atomic<uint64_t> dropped[BB_SOURCE_COUNT];
+
+	std::string path;
+	int fd;
+	unsigned segment;
+	size_t segment_block;
+	uint32_t block_seq;
+	size_t blocks_unsynced;
+	uint8_t* block;
+	size_t used;
+	bool direct;
+
+	std::atomic<bool> running;
+	std::thread writer;
+
+	std::atomic<uint64_t> written;
+	std::atomic<uint64_t> blocks;
+	std::atomic<uint64_t> syncs;
+	std::atomic<uint64_t> write_errors;
+};
+
+#endif //RECORDER_H
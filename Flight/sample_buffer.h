@@ -0,0 +1,108 @@
+#ifndef SAMPLE_BUFFER_H
+#define SAMPLE_BUFFER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <atomic>
+
+#include "spsc.h"
+
+// Time-indexed sample history, one writer and any number of readers.
+//
+// Each acquisition thread owns one of these and pushes every sample it reads, stamped from the
+// shared bcm2835 system timer. Readers on other threads can ask for the newest sample or the one
+// closest to a given timestamp, which is how samples from the two IMUs are lined up against each
+// other. Slots are guarded by per-slot sequence counters (a seqlock), so the writer never waits
+// for a reader and a reader simply retries if it raced an overwrite.
+//
+// T must be trivially copyable and have a uint64_t timestamp member.
+
+template<typename T, size_t N>
+class sample_history {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "sample_history size must be a power of two");
+
+public:
+	sample_history() : count(0) {
+		for(size_t i = 0; i < N; i++)
+			slots[i].seq = 0;
+	}
+
+	// Writer side.
+	void push(const T& sample) {
+		uint64_t n = count.load(std::memory_order_relaxed);
+		slot& s = slots[n & (N - 1)];
+		uint32_t seq = s.seq.load(std::memory_order_relaxed);
+
+		s.seq.store(seq + 1, std::memory_order_relaxed); // Odd: write in progress.
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(&s.data, &sample, sizeof(T));
+		s.seq.store(seq + 2, std::memory_order_release);
+
+		count.store(n + 1, std::memory_order_release);
+	}
+
+	// Total samples ever pushed.
+	uint64_t size() const { return count.load(std::memory_order_acquire); }
+
+	bool latest(T& out) const {
+		uint64_t n = count.load(std::memory_order_acquire);
+
+		for(int tries = 0; n > 0 && tries < 4; tries++)
+			if(read(n - 1, out))
+				return true;
+
+		return false;
+	}
+
+	// Finds the retained sample whose timestamp is closest to t.
+	bool nearest(uint64_t t, T& out) const {
+		uint64_t n = count.load(std::memory_order_acquire);
+		uint64_t oldest = n > N / 2 ? n - N / 2 : 0; // Stay well clear of the slots the writer is reusing.
+		uint64_t best_diff = UINT64_MAX;
+		bool found = false;
+		T sample;
+
+		// Newest first; timestamps only go up, so stop once they start moving away from t.
+		for(uint64_t i = n; i > oldest; i--) {
+			if(!read(i - 1, sample))
+				continue;
+
+			uint64_t diff = sample.timestamp > t ? sample.timestamp - t : t - sample.timestamp;
+
+			if(diff > best_diff)
+				break;
+
+			best_diff = diff;
+			out = sample;
+			found = true;
+		}
+
+		return found;
+	}
+
+private:
+	bool read(uint64_t index, T& out) const {
+		const slot& s = slots[index & (N - 1)];
+		uint32_t before = s.seq.load(std::memory_order_acquire);
+
+		if(before & 1)
+			return false;
+
+		memcpy(&out, &s.data, sizeof(T));
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		return s.seq.load(std::memory_order_relaxed) == before;
+	}
+
+	struct slot {
+		std::atomic<uint32_t> seq;
+		T data;
+	};
+
+	alignas(CACHE_LINE) std::atomic<uint64_t> count;
+	slot slots[N];
+};
+
+#endif //SAMPLE_BUFFER_H
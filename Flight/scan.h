@@ -0,0 +1,154 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "telemetry.h"
+
+// Frame resynchronization for arbitrary byte streams (SDR captures, recorder dumps, UDP).
+//
+// A frame is accepted wherever FRAME_START is followed FRAME_LEN - 1 bytes later by FRAME_END.
+// Both delimiters are tested 16 positions at a time with SSE2 (x86) or NEON (the Pi): one
+// compare against the start byte, one against the bytes 17 further on, AND, and only the
+// surviving lanes are looked at individually. Frames never overlap: a candidate that starts inside
+// an accepted frame is a delimiter byte in its payload, not a frame.
+
+#define SCAN_BLOCK 16
+
+#if defined(__SSE2__)
+#define SCAN_LANE_BITS 1 // Bits per lane in a scan_block() mask.
+
+static inline uint64_t scan_block(const uint8_t* p, uint8_t start, uint8_t end) {
+	__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi8((char)start));
+	__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + FRAME_LEN - 1)), _mm_set1_epi8((char)end));
+	return (uint32_t)_mm_movemask_epi8(_mm_and_si128(a, b));
+}
+
+// Lanes of p[0, 16) equal to either byte.
+static inline uint64_t scan_either(const uint8_t* p, uint8_t x, uint8_t y) {
+	__m128i v = _mm_loadu_si128((const __m128i*)p);
+	return (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)x)), _mm_cmpeq_epi8(v, _mm_set1_epi8((char)y))));
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SCAN_LANE_BITS 4
+
+// NEON has no movemask; narrowing each 16-bit pair by 4 leaves a nibble per lane in 64 bits.
+static inline uint64_t scan_block(const uint8_t* p, uint8_t start, uint8_t end) {
+	uint8x16_t a = vceqq_u8(vld1q_u8(p), vdupq_n_u8(start));
+	uint8x16_t b = vceqq_u8(vld1q_u8(p + FRAME_LEN - 1), vdupq_n_u8(end));
+	uint8x8_t m = vshrn_n_u16(vreinterpretq_u16_u8(vandq_u8(a, b)), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(m), 0);
+}
+
+static inline uint64_t scan_either(const uint8_t* p, uint8_t x, uint8_t y) {
+	uint8x16_t v = vld1q_u8(p);
+	uint8x16_t e = vorrq_u8(vceqq_u8(v, vdupq_n_u8(x)), vceqq_u8(v, vdupq_n_u8(y)));
+	uint8x8_t m = vshrn_n_u16(vreinterpretq_u16_u8(e), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(m), 0);
+}
+
+#else
+#define SCAN_LANE_BITS 1
+
+static inline uint64_t scan_block(const uint8_t* p, uint8_t start, uint8_t end) {
+	uint64_t mask = 0;
+
+	for(int i = 0; i < SCAN_BLOCK; i++)
+		mask |= (uint64_t)(p[i] == start && p[i + FRAME_LEN - 1] == end) << i;
+
+	return mask;
+}
+
+static inline uint64_t scan_either(const uint8_t* p, uint8_t x, uint8_t y) {
+	uint64_t mask = 0;
+
+	for(int i = 0; i < SCAN_BLOCK; i++)
+		mask |= (uint64_t)(p[i] == x || p[i] == y) << i;
+
+	return mask;
+}
+#endif
+
+// Finds complete frames in data[0, len) and writes up to max of their offsets, in order. Returns
+// how many it wrote. resume is where the next scan should start: after the last frame if max was
+// reached, otherwise the first offset that was too close to the end to check. For a stream,
+// keep data[resume, len) and append to it.
+size_t scan_frames(const uint8_t* data, size_t len, size_t* offsets, size_t max, size_t& resume) {
+	size_t n = 0;
+	size_t i = 0;
+
+	while(n < max && i + SCAN_BLOCK + FRAME_LEN - 1 <= len) {
+		// In a clean stream the next frame starts right where the last one ended; check that first.
+		if(data[i] == FRAME_START && data[i + FRAME_LEN - 1] == FRAME_END) {
+			offsets[n++] = i;
+			i += FRAME_LEN;
+			continue;
+		}
+
+		uint64_t mask = scan_block(data + i, FRAME_START, FRAME_END);
+
+		if(mask == 0) {
+			i += SCAN_BLOCK;
+			continue;
+		}
+
+		// Take the first candidate and restart the block after it, so later lanes inside it are never seen.
+		i += __builtin_ctzll(mask) / SCAN_LANE_BITS;
+		offsets[n++] = i;
+		i += FRAME_LEN;
+	}
+
+	for(; n < max && i + FRAME_LEN <= len; i++)
+		if(data[i] == FRAME_START && data[i + FRAME_LEN - 1] == FRAME_END) {
+			offsets[n++] = i;
+			i += FRAME_LEN - 1;
+		}
+
+	resume = i;
+	return n;
+}
+
+// First offset at or after from holding either byte, or len. For skipping noise between records
+// when more than one kind of record can start the next one (frames and delta records).
+size_t scan_find(const uint8_t* data, size_t len, size_t from, uint8_t x, uint8_t y) {
+	size_t i = from;
+
+	for(; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+		uint64_t mask = scan_either(data + i, x, y);
+
+		if(mask)
+			return i + __builtin_ctzll(mask) / SCAN_LANE_BITS;
+	}
+
+	for(; i < len; i++)
+		if(data[i] == x || data[i] == y)
+			return i;
+
+	return len;
+}
+
+// Byte-at-a-time reference for scan_frames(), same results.
+size_t scan_frames_scalar(const uint8_t* data, size_t len, size_t* offsets, size_t max, size_t& resume) {
+	size_t n = 0;
+	size_t i = 0;
+
+	for(; i + FRAME_LEN <= len && n < max; i++)
+		if(data[i] == FRAME_START && data[i + FRAME_LEN - 1] == FRAME_END) {
+			offsets[n++] = i;
+			i += FRAME_LEN - 1;
+		}
+
+	resume = i;
+	return n;
+}
+
+#endif //SCAN_H
@@ -0,0 +1,118 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+
+#include <bcm2835.h>
+
+#include "histogram.h"
+#include "timebase.h"
+
+// Deadline-driven acquisition scheduling.
+//
+// acq_scheduler paces a sensor loop against absolute deadlines on the BCM2835 1 MHz system timer
+// instead of sleeping a fixed interval after each read, so the loop period doesn't drift by however
+// long the read took. It sleeps in the kernel until just short of the deadline and then spins on
+// bcm2835_st_read() for the last stretch. If a data-ready GPIO is given, it instead waits for the
+// IMU's rising edge (bcm2835_gpio_ren/eds), with the timer deadline as a fallback if the edge
+// never comes. Every wakeup's lateness, and the actual period since the previous wakeup, are
+// recorded in latency_histograms.
+
+#define SCHED_SPIN_US 100 // Spin this long before each deadline instead of trusting the kernel wakeup.
+#define SCHED_NO_PIN 0xFF
+
+class acq_scheduler {
+public:
+	// rate_hz 1 - 1000000, so the period is at least 1 us. drdy_pin is a bcm2835 GPIO number, or SCHED_NO_PIN for timer-only pacing.
+	acq_scheduler(unsigned rate_hz, uint8_t drdy_pin = SCHED_NO_PIN) : period(1000000 / rate_hz), pin(drdy_pin), next(0), last(0), overruns(0) {}
+
+	// Call once bcm2835 is initialized, right before the loop.
+	void start() {
+		if(pin != SCHED_NO_PIN) {
+			bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_INPT);
+			bcm2835_gpio_set_pud(pin, BCM2835_GPIO_PUD_DOWN);
+			bcm2835_gpio_ren(pin);
+			bcm2835_gpio_set_eds(pin);
+		}
+
+		next = st_read() + period;
+	}
+
+	// Blocks until the next sample is due and returns the wake timestamp.
+	uint64_t wait() {
+		uint64_t now;
+
+		if(pin != SCHED_NO_PIN) {
+			// Edge-driven: the IMU says when. Give up a full period late and fall back to the timer.
+			uint64_t timeout = next + period;
+
+			while(!bcm2835_gpio_eds(pin) && (now = st_read()) < timeout)
+				sleep_until(now + SCHED_SPIN_US < timeout ? now + SCHED_SPIN_US : timeout, now);
+
+			bcm2835_gpio_set_eds(pin);
+		} else {
+			now = st_read();
+
+			if(next > now + SCHED_SPIN_US)
+				sleep_until(next - SCHED_SPIN_US, now);
+
+			while(st_read() < next) {}
+		}
+
+		now = st_read();
+		jitter.add((int64_t)now - (int64_t)next);
+
+		if(last)
+			periods.add((int64_t)(now - last) - (int64_t)period);
+		last = now;
+
+		// The IMU runs off its own oscillator, so edge mode re-anchors on every edge.
+		if(pin != SCHED_NO_PIN) {
+			next = now + period;
+			return now;
+		}
+
+		next += period;
+
+		// Fell more than a period behind: skip the missed slots rather than bursting to catch up.
+		if(now >= next) {
+			overruns += (now - next) / period + 1;
+			next += ((now - next) / period + 1) * period;
+		}
+
+		return now;
+	}
+
+	uint32_t period_us() const { return period; }
+	uint64_t missed() const { return overruns; }
+	const latency_histogram& stats() const { return jitter; }
+	const latency_histogram& period_stats() const { return periods; } // Deviation from the nominal period.
+
+	// Longest observed gap between two wakeups.
+	int64_t worst_period_us() const { return periods.samples() ? (int64_t)period + periods.worst() : 0; }
+
+private:
+	static void sleep_until(uint64_t deadline, uint64_t now) {
+		if(deadline <= now)
+			return;
+
+		uint64_t us = (uint64_t)((deadline - now) / st_speed); // Wall-clock time, even when simulated.
+		struct timespec ts;
+		ts.tv_sec = us / 1000000;
+		ts.tv_nsec = (us % 1000000) * 1000;
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+	}
+
+	uint32_t period;
+	uint8_t pin;
+	uint64_t next;
+	uint64_t last;
+	uint64_t overruns;
+	latency_histogram jitter;
+	latency_histogram periods;
+};
+
+#endif //SCHEDULER_H
@@ -0,0 +1,281 @@
+#ifndef SENSOR_SOURCE_H
+#define SENSOR_SOURCE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <random>
+#include <string>
+
+#include <RTIMULib.h>
+
+#include "recorder.h"
+#include "timebase.h"
+
+// Where payload's IMU samples come from.
+//
+// rtimu_source is the flight hardware: an RTIMULib IMU and, for mpu_main, the barometer. The
+// other two let payload run on any Linux box with no sensors and no bcm2835 (st_simulated):
+//
+//   sim_source     plays a synthetic flight (pad, boost, coast, apogee, drogue, main, landed) from a
+//                  point-mass model, with per-IMU sensor noise and the accelerometer's range limit.
+//   replay_source  plays back a black-box recording (payload --blackbox) in its original timing.
+//
+// Both produce samples on the st_read() timebase, so with st_speed > 1 a whole flight runs through
+// fusion, packing, TX and recording that many times faster than real time. A source that falls
+// further behind than SIM_MAX_LAG_US skips samples (counted) rather than keep the loop from ever
+// getting back to its scheduler.
+
+#define SIM_MAX_LAG_US 100000
+
+// Synthetic flight. About 3000 m apogee at 27 s, drogue descent at ~30 m/s, main at SIM_MAIN_ALT.
+#define SIM_PAD_US 5000000 // On the pad before ignition.
+#define SIM_BURN_US 4000000
+#define SIM_THRUST 80.0 // Motor acceleration, m/s^2. Gravity and drag are applied separately.
+#define SIM_DRAG_BODY 0.00015 // Drag acceleration over v^2, 1/m.
+#define SIM_DRAG_DROGUE 0.011
+#define SIM_DRAG_MAIN 0.27
+#define SIM_MAIN_ALT 450.0 // m AGL.
+#define SIM_LANDED_US 10000000 // Keep sampling this long after touchdown, then finish.
+#define SIM_ACCEL_RANGE 16.0 // g, as fusion's default_fusion_config().
+#define SIM_G 9.80665
+
+class sensor_source {
+public:
+	virtual ~sensor_source() {}
+
+	// Fills data and returns true if a new sample is ready; RTIMU::IMURead() + getIMUData(), plus
+	// pressureRead() for a source with a barometer.
+	virtual bool read(RTIMU_DATA& data) = 0;
+
+	// True once a simulated or replayed flight has no more samples. Hardware never finishes.
+	virtual bool finished() const { return false; }
+
+	uint64_t skipped() const { return lagged; }
+
+protected:
+	sensor_source() : lagged(0) {}
+
+	uint64_t lagged;
+};
+
+class rtimu_source : public sensor_source {
+public:
+	rtimu_source(RTIMU* imu, RTPressure* baro = NULL) : imu(imu), baro(baro) {}
+
+	bool read(RTIMU_DATA& data) {
+		if(!imu->IMURead())
+			return false;
+
+		data = imu->getIMUData();
+
+		if(baro != NULL)
+			baro->pressureRead(data);
+
+		return true;
+	}
+
+private:
+	RTIMU* imu;
+	RTPressure* baro;
+};
+
+class sim_source : public sensor_source {
+public:
+	// seed picks this IMU's noise, so two sim_sources fly the same flight with independent sensors.
+	sim_source(unsigned rate_hz, unsigned seed, bool has_baro) : period(1000000 / rate_hz), baro(has_baro), rng(seed), noise(0, 1),
+		start(0), next(0), t(0), alt(0), vel(0), accel(0), roll(0), apogee(false), landed_at(0) {}
+
+	bool read(RTIMU_DATA& data) {
+		uint64_t now = st_read();
+
+		if(start == 0)
+			start = next = now;
+
+		if(next > now || finished())
+			return false;
+
+		while(now - next > SIM_MAX_LAG_US) {
+			step();
+			lagged++;
+		}
+
+		step();
+		fill(data);
+
+		return true;
+	}
+
+	bool finished() const { return landed_at != 0 && t - landed_at > SIM_LANDED_US; }
+
+private:
+	// Advances the model one sample period.
+	void step() {
+		double dt = period / 1e6;
+		double drag = !apogee ? SIM_DRAG_BODY : alt > SIM_MAIN_ALT ? SIM_DRAG_DROGUE : SIM_DRAG_MAIN;
+
+		next += period;
+		t += period;
+
+		if(t < SIM_PAD_US || landed_at) {
+			accel = 0;
+			return;
+		}
+
+		accel = (t < SIM_PAD_US + SIM_BURN_US ? SIM_THRUST : 0) - SIM_G - drag * vel * fabs(vel);
+		vel += accel * dt;
+		alt += vel * dt;
+
+		if(!apogee && t > SIM_PAD_US + SIM_BURN_US && vel <= 0)
+			apogee = true;
+
+		if(apogee && alt <= 0) {
+			alt = vel = accel = 0;
+			landed_at = t;
+		}
+
+		// Spin up with airspeed, then a slow twist under canopy.
+		roll = fmod(roll + (apogee ? 20.0 : 0.5 * vel) * dt + 180, 360.0) - 180;
+	}
+
+	void fill(RTIMU_DATA& data) {
+		data = RTIMU_DATA();
+		data.timestamp = next;
+
+		// The accelerometer reads specific force along the body axis: 1 g at rest, thrust minus
+		// drag in flight, and it pins at its range on deployment.
+		float az = (accel + SIM_G) / SIM_G + 0.01 * noise(rng);
+		az = az > SIM_ACCEL_RANGE ? SIM_ACCEL_RANGE : az < -SIM_ACCEL_RANGE ? -SIM_ACCEL_RANGE : az;
+
+		float spin = landed_at ? 0 : apogee ? 20.0 : 0.5 * vel;
+		float sway = apogee && !landed_at ? 5 * sin(t / 1e6) : 0; // deg, swinging under the canopy.
+
+		data.accelValid = data.gyroValid = data.compassValid = data.fusionPoseValid = true;
+		data.accel = RTVector3(0.01 * noise(rng), 0.01 * noise(rng), az);
+		data.gyro = RTVector3(0.1 * noise(rng), 0.1 * noise(rng), spin + 0.1 * noise(rng));
+		data.compass = RTVector3(20 * cos(roll * RTMATH_DEGREE_TO_RAD), 20 * sin(roll * RTMATH_DEGREE_TO_RAD), 40);
+
+		// RTIMULib reports the pose in radians; payload converts to degrees.
+		data.fusionPose = RTVector3(roll * RTMATH_DEGREE_TO_RAD, sway * RTMATH_DEGREE_TO_RAD, 0);
+
+		if(baro) {
+			// Standard atmosphere from sea level, the inverse of RTMath::convertPressureToHeight().
+			data.pressureValid = data.temperatureValid = true;
+			data.pressure = 1013.25 * pow(1 - 2.25577e-5 * alt, 5.25588) + 0.02 * noise(rng);
+			data.temperature = 15 - 0.0065 * alt;
+		}
+	}
+
+	uint64_t period;
+	bool baro;
+	std::mt19937 rng;
+	std::normal_distribution<float> noise;
+
+	uint64_t start;
+	uint64_t next; // st_read() time of the next sample.
+	uint64_t t; // Flight time, us.
+	double alt, vel, accel; // m AGL, m/s, m/s^2.
+	double roll; // deg
+	bool apogee;
+	uint64_t landed_at;
+};
+
+class replay_source : public sensor_source {
+public:
+	replay_source() : has_baro(false), have_next(false), have_baro(false), baro_valid(false), done(false), start(0), t0(0) {}
+
+	// Replays one IMU (BB_MPU_MAIN or BB_MPU_AUX) from a recording directory. with_baro merges in the
+	// barometer records, as rtimu_source does for mpu_main.
+	bool open(const std::string& dir, bb_source imu, bool with_baro) {
+		has_baro = with_baro;
+
+		if(!samples.open(dir, 1u << imu))
+			return false;
+
+		if(has_baro && baro.open(dir, 1u << BB_BARO))
+			have_baro = baro.next(next_baro);
+
+		have_next = samples.next(next_sample);
+		done = !have_next;
+
+		return have_next;
+	}
+
+	bool read(RTIMU_DATA& data) {
+		uint64_t now = st_read();
+
+		if(!have_next)
+			return false;
+
+		if(start == 0) {
+			start = now;
+			t0 = next_sample.timestamp;
+		}
+
+		if(next_sample.timestamp - t0 > now - start)
+			return false;
+
+		// Too far behind: drop to within SIM_MAX_LAG_US of where we should be.
+		while(have_next && (now - start) - (next_sample.timestamp - t0) > SIM_MAX_LAG_US) {
+			have_next = samples.next(next_sample);
+			lagged++;
+		}
+
+		if(!have_next) {
+			done = true;
+			return false;
+		}
+
+		data = RTIMU_DATA();
+		data.timestamp = next_sample.timestamp;
+		data.accelValid = next_sample.valid & BB_VALID_ACCEL;
+		data.gyroValid = next_sample.valid & BB_VALID_GYRO;
+		data.compassValid = next_sample.valid & BB_VALID_COMPASS;
+		data.fusionPoseValid = next_sample.valid & BB_VALID_POSE;
+		data.accel = RTVector3(next_sample.accel[0], next_sample.accel[1], next_sample.accel[2]);
+		data.gyro = RTVector3(next_sample.gyro[0], next_sample.gyro[1], next_sample.gyro[2]);
+		data.compass = RTVector3(next_sample.compass[0], next_sample.compass[1], next_sample.compass[2]);
+		data.fusionPose = RTVector3(next_sample.pose[0] * RTMATH_DEGREE_TO_RAD, next_sample.pose[1] * RTMATH_DEGREE_TO_RAD,
+		                            next_sample.pose[2] * RTMATH_DEGREE_TO_RAD);
+
+		// The newest barometer reading taken no later than this sample.
+		while(have_baro && next_baro.timestamp <= next_sample.timestamp) {
+			last_baro = next_baro;
+			have_baro = baro.next(next_baro);
+			baro_valid = true;
+		}
+
+		if(has_baro && baro_valid) {
+			data.pressureValid = last_baro.valid & BB_VALID_PRESSURE;
+			data.temperatureValid = last_baro.valid & BB_VALID_TEMP;
+			data.pressure = last_baro.pressure;
+			data.temperature = last_baro.temperature / 100.0;
+		}
+
+		have_next = samples.next(next_sample);
+		done = !have_next;
+
+		return true;
+	}
+
+	bool finished() const { return done; }
+
+private:
+	bb_reader samples;
+	bb_reader baro;
+	bool has_baro;
+
+	bb_record next_sample;
+	bb_record next_baro;
+	bb_record last_baro;
+	bool have_next;
+	bool have_baro;
+	bool baro_valid;
+	bool done;
+
+	uint64_t start;
+	uint64_t t0; // Recording time of the first sample.
+};
+
+#endif //SENSOR_SOURCE_H
@@ -0,0 +1,107 @@
+#ifndef SPI_LOCK_H
+#define SPI_LOCK_H
+
+#include <cerrno>
+#include <cstring>
+
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+// SPI0 is shared between processes: radio drives the RF95 on it (CE0, chip select by GPIO) and
+// payload reads the battery ADC on CE1. bcm2835 writes the SPI controller's registers directly
+// from each process with nothing in between, so both hold spi_lock around every transaction, and
+// a process that changes the controller's setup puts it back before unlocking.
+//
+// The lock is an flock() on SPI_LOCK_FILE, opened by open() or on first use. If it can't be
+// opened, locking does nothing.
+//
+// flock() has no priority inheritance, so a low-priority holder preempted mid-transaction would
+// leave radio's SCHED_FIFO loop blocked for as long as the scheduler likes. A process whose
+// holders run below the radio sets a ceiling: lock() raises the calling thread to SCHED_FIFO at
+// that priority before taking the flock and unlock() puts its old policy back after releasing it,
+// so the hold can only be preempted by threads that outrank the radio anyway. Holders keep it to
+// one transfer (about 30 us for the battery ADC), which bounds how long the radio can wait.
+
+#define SPI_LOCK_FILE "/var/lock/tecs-spi0"
+
+class spi_lock {
+public:
+	spi_lock() : fd(-1), opened(false), ceiling(0), raised(false), old_policy(SCHED_OTHER) {}
+
+	~spi_lock() {
+		if(fd >= 0)
+			close(fd);
+	}
+
+	bool open() {
+		if(!opened) {
+			fd = ::open(SPI_LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+			opened = true;
+		}
+
+		return fd >= 0;
+	}
+
+	// SCHED_FIFO priority holders run at; 0 (the default) leaves them alone. A thread already at
+	// or above the ceiling isn't changed. Without the privilege to raise, the lock still works.
+	void set_ceiling(int priority) { ceiling = priority; }
+
+	void lock() {
+		raise();
+
+		if(open())
+			while(flock(fd, LOCK_EX) < 0 && errno == EINTR);
+	}
+
+	void unlock() {
+		if(fd >= 0)
+			flock(fd, LOCK_UN);
+
+		restore();
+	}
+
+private:
+	void raise() {
+		if(ceiling <= 0 || pthread_getschedparam(pthread_self(), &old_policy, &old_param) != 0)
+			return;
+
+		if(old_policy != SCHED_OTHER && old_policy != SCHED_BATCH && old_policy != SCHED_IDLE && old_param.sched_priority >= ceiling)
+			return;
+
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = ceiling;
+
+		raised = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+	}
+
+	void restore() {
+		if(raised)
+			pthread_setschedparam(pthread_self(), old_policy, &old_param);
+
+		raised = false;
+	}
+
+	int fd;
+	bool opened;
+
+	// Ceiling state; only the locking thread touches it, between its lock() and unlock().
+	int ceiling;
+	bool raised;
+	int old_policy;
+	struct sched_param old_param;
+};
+
+class spi_guard {
+public:
+	spi_guard(spi_lock& l) : l(l) { l.lock(); }
+	~spi_guard() { l.unlock(); }
+
+private:
+	spi_lock& l;
+};
+
+#endif //SPI_LOCK_H
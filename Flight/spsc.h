@@ -0,0 +1,139 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+// Lock-free single-producer/single-consumer ring queue.
+//
+// Exactly one thread may push and exactly one thread may pop. Neither side ever blocks or
+// allocates: push() fails when the ring is full and pop() fails when it's empty, and the caller
+// decides what to do about it (usually count a drop and move on). N must be a power of two.
+
+#define CACHE_LINE 64
+
+template<typename T, size_t N>
+class spsc_queue {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "spsc_queue size must be a power of two");
+
+public:
+	spsc_queue() : head(0), tail(0) {}
+
+	// Producer side.
+	bool push(const T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+
+		if(h - tail.load(std::memory_order_acquire) == N)
+			return false;
+
+		ring[h & (N - 1)] = item;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side.
+	bool pop(T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+
+		if(t == head.load(std::memory_order_acquire))
+			return false;
+
+		item = ring[t & (N - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Approximate when called from a third thread, exact from either end.
+	size_t size() const {
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+
+	static size_t capacity() { return N; }
+
+private:
+	// Head and tail on separate cache lines so the two threads don't false-share.
+	alignas(CACHE_LINE) std::atomic<size_t> head;
+	alignas(CACHE_LINE) std::atomic<size_t> tail;
+	alignas(CACHE_LINE) T ring[N];
+};
+
+// Single-producer/single-consumer ring that drops the oldest entry instead of refusing new ones.
+//
+// push() always succeeds and never waits for the consumer. If the consumer has fallen a whole ring
+// behind, pop() skips forward past the overwritten entries and reports how many it lost. Each
+// slot carries the index that last wrote it, so a pop that races an overwrite is detected and
+// counted as a drop rather than returning a torn entry.
+
+template<typename T, size_t N>
+class spsc_overwrite_queue {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "spsc_overwrite_queue size must be a power of two");
+
+public:
+	spsc_overwrite_queue() : head(0), tail(0) {
+		for(size_t i = 0; i < N; i++)
+			slots[i].seq = 0;
+	}
+
+	// Producer side.
+	void push(const T& item) {
+		uint64_t h = head.load(std::memory_order_relaxed);
+		slot& s = slots[h & (N - 1)];
+
+		s.seq.store(2 * h + 1, std::memory_order_relaxed); // Odd: write in progress.
+		std::atomic_thread_fence(std::memory_order_release);
+		s.data = item;
+		s.seq.store(2 * h + 2, std::memory_order_release);
+
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	// Consumer side. Adds the number of entries lost to overwrites to dropped.
+	bool pop(T& item, uint64_t& dropped) {
+		while(true) {
+			uint64_t t = tail.load(std::memory_order_relaxed);
+			uint64_t h = head.load(std::memory_order_acquire);
+
+			if(t == h)
+				return false;
+
+			if(h - t > N) {
+				dropped += h - t - N;
+				t = h - N;
+			}
+
+			const slot& s = slots[t & (N - 1)];
+			uint64_t before = s.seq.load(std::memory_order_acquire);
+
+			item = s.data;
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			bool intact = before == 2 * t + 2 && s.seq.load(std::memory_order_relaxed) == before;
+
+			tail.store(t + 1, std::memory_order_release);
+
+			if(intact)
+				return true;
+
+			dropped++;
+		}
+	}
+
+	// Entries waiting, capped at N. Approximate from any thread but the consumer.
+	size_t size() const {
+		uint64_t d = head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+		return d > N ? N : (size_t)d;
+	}
+
+private:
+	struct slot {
+		std::atomic<uint64_t> seq;
+		T data;
+	};
+
+	alignas(CACHE_LINE) std::atomic<uint64_t> head;
+	alignas(CACHE_LINE) std::atomic<uint64_t> tail;
+	alignas(CACHE_LINE) slot slots[N];
+};
+
+#endif //SPSC_H
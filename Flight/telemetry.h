@@ -0,0 +1,302 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <array>
+
+#include "bitstream.h"
+
+// Telemetry frame schema. Mirrors "telemetry layout.txt".
+//
+// Each field is described once, in wire order, as tlm_field<bits, signed>. The packer and
+// unpacker below are generated from that list at compile time: every field's bit offset is a
+// template constant, so packing a frame is a fixed sequence of shifts and ORs with no loops,
+// and a field that straddles the 64-bit word boundary (Gz) is split automatically.
+//
+// To add a field: add an entry to tlm_index, add its tlm_field to tlm_schema in the same
+// position, and take the bits from another field so the static_assert below still holds.
+
+#define FRAME_START 0x5e
+#define FRAME_END 0xd5
+
+enum tlm_index {
+	TLM_FPS = 0, // 1  - [6]  flight profile state
+	TLM_ERR,     // 2  - [6]  error buffer
+	TLM_AX,      // 3  - [6]  Ax - [-32, 31] - real values: [-20, 20]
+	TLM_AY,      // 4  - [6]  Ay - [-32, 31] - real values: [-20, 20]
+	TLM_AZ,      // 5  - [9]  Az - [-256, 255] - real values: [-160, 160]
+	TLM_GX,      // 6  - [10] Gx - [-512, 511] - real values: [-500, 500]
+	TLM_GY,      // 7  - [10] Gy - [-512, 511] - real values: [-500, 500]
+	TLM_GZ,      // 8  - [12] Gz - [-2048, 2047] - real values: [-2000, 2000]
+	TLM_ROLL,    // 9  - [9]  roll  - [-256, 255] - real values: (-180, 180)
+	TLM_PITCH,   // 10 - [9]  pitch - [-256, 255] - real values: (-180, 180)
+	TLM_YAW,     // 11 - [9]  yaw   - [-256, 255] - real values: (-180, 180)
+	TLM_ALT,     // 12 - [12] alt. above the pad - [0, 4095] - real values: ~[0, 3200]
+	TLM_TEMP,    // 13 - [8]  temp. - [-128, 127] - real values: ~[-30, 100]
+	TLM_VOLTS,   // 14 - [8]  volts - [0, 255] - real values: ~[20, 170]
+	TLM_SEQ,     // 15 - [8]  frame sequence number, wraps
+	TLM_FIELD_COUNT
+};
+
+template<size_t Bits, bool Signed>
+struct tlm_field {
+	static_assert(Bits > 0 && Bits < 64, "telemetry fields must be 1 - 63 bits wide");
+
+	static const size_t bits = Bits;
+	static const bool is_signed = Signed;
+	static const uint64_t mask = 0xFFFFFFFFFFFFFFFF >> (64 - Bits);
+};
+
+// Writes/reads one field at a fixed bit offset (counted from the MSB of words[0]) in an array of
+// Word-sized words. The Split parameter selects the word-straddling variant at compile time.
+template<typename Word, size_t Offset, typename F, bool Split = ((Offset % (8 * sizeof(Word))) + F::bits > 8 * sizeof(Word))>
+struct tlm_slot {
+	static const size_t word_bits = 8 * sizeof(Word);
+	static const size_t word = Offset / word_bits;
+	static const size_t shift = word_bits - (Offset % word_bits) - F::bits;
+
+	static inline void put(Word* words, int64_t value) {
+		words[word] |= (Word)((uint64_t)value & F::mask) << shift;
+	}
+
+	static inline uint64_t get(const Word* words) {
+		return (words[word] >> shift) & F::mask;
+	}
+};
+
+template<typename Word, size_t Offset, typename F>
+struct tlm_slot<Word, Offset, F, true> {
+	static_assert(F::bits <= 8 * sizeof(Word), "telemetry field wider than the packing word");
+
+	static const size_t word_bits = 8 * sizeof(Word);
+	static const size_t word = Offset / word_bits;
+	static const size_t lo_bits = (Offset % word_bits) + F::bits - word_bits; // Bits that spill into the next word.
+
+	static inline void put(Word* words, int64_t value) {
+		Word v = (Word)((uint64_t)value & F::mask);
+		words[word] |= v >> lo_bits;
+		words[word + 1] |= v << (word_bits - lo_bits);
+	}
+
+	static inline uint64_t get(const Word* words) {
+		return (uint64_t)((words[word] << lo_bits) | (words[word + 1] >> (word_bits - lo_bits))) & F::mask;
+	}
+};
+
+template<size_t Offset, typename... Fields>
+struct tlm_packer;
+
+template<size_t Offset>
+struct tlm_packer<Offset> {
+	static const size_t bits = 0;
+
+	static inline void pack(uint64_t*, const int64_t*) {}
+	static inline void unpack(const uint64_t*, int64_t*) {}
+
+	static inline void pack_column(uint32_t*, const int32_t* const*, size_t) {}
+	static inline void unpack_column(const uint32_t*, int32_t* const*, size_t) {}
+};
+
+template<size_t Offset, typename F, typename... Rest>
+struct tlm_packer<Offset, F, Rest...> {
+	typedef tlm_packer<Offset + F::bits, Rest...> next;
+
+	static const size_t bits = F::bits + next::bits;
+
+	static inline void pack(uint64_t* words, const int64_t* values) {
+		tlm_slot<uint64_t, Offset, F>::put(words, values[0]);
+		next::pack(words, values + 1);
+	}
+
+	static inline void unpack(const uint64_t* words, int64_t* values) {
+		uint64_t raw = tlm_slot<uint64_t, Offset, F>::get(words);
+
+		if(F::is_signed && (raw & (F::mask ^ (F::mask >> 1))))
+			raw |= ~F::mask;
+
+		values[0] = (int64_t)raw;
+		next::unpack(words, values + 1);
+	}
+
+	// Packs frame i of columnar input (columns[field][frame]) into 32-bit words. Narrower lanes
+	// than pack() so a loop over frames vectorizes four frames per 128-bit register.
+	static inline void pack_column(uint32_t* words, const int32_t* const* columns, size_t i) {
+		tlm_slot<uint32_t, Offset, F>::put(words, columns[0][i]);
+		next::pack_column(words, columns + 1, i);
+	}
+
+	static inline void unpack_column(const uint32_t* words, int32_t* const* columns, size_t i) {
+		uint32_t raw = (uint32_t)tlm_slot<uint32_t, Offset, F>::get(words);
+
+		columns[0][i] = F::is_signed ? (int32_t)(raw << (32 - F::bits)) >> (32 - F::bits) : (int32_t)raw;
+		next::unpack_column(words, columns + 1, i);
+	}
+};
+
+template<typename... Fields>
+struct tlm_frame_schema {
+	typedef tlm_packer<0, Fields...> packer;
+
+	static const size_t field_count = sizeof...(Fields);
+	static const size_t bits = packer::bits;
+	static const size_t words = (bits + 63) / 64;
+	static const size_t payload_len = bits / 8;
+	static const size_t frame_len = payload_len + 2; // Start and end delimiters.
+
+	// Per-field width and signedness at runtime, for code that walks the fields in a loop.
+	static size_t field_bits(size_t i) {
+		static const size_t b[] = {Fields::bits...};
+		return b[i];
+	}
+
+	static bool field_signed(size_t i) {
+		static const bool s[] = {Fields::is_signed...};
+		return s[i];
+	}
+
+	static_assert(bits % 8 == 0, "telemetry frame must be a whole number of bytes");
+
+	// Packs values[field_count] into the frame payload (no delimiters), big-endian.
+	static void pack(const int64_t* values, uint8_t* payload) {
+		uint64_t w[words] = {};
+
+		packer::pack(w, values);
+		store_words(w, payload);
+	}
+
+	// Unpacks a frame payload (no delimiters) into values[field_count], sign-extending signed fields.
+	static void unpack(const uint8_t* payload, int64_t* values) {
+		uint64_t w[words];
+
+		load_words(payload, w);
+		packer::unpack(w, values);
+	}
+
+	// Writes a full delimited frame of frame_len bytes.
+	static void pack_frame(const int64_t* values, uint8_t* frame) {
+		frame[0] = FRAME_START;
+		pack(values, frame + 1);
+		frame[frame_len - 1] = FRAME_END;
+	}
+
+	// Packs n frames from columnar input (columns[field][frame]) into n back-to-back delimited frames.
+	// A block of frames is built in a branch-free loop with no cross-frame dependency, which the
+	// compiler vectorizes (NEON/SSE2), then copied out one frame at a time.
+	static void pack_columns(const int32_t* const* columns, size_t n, uint8_t* frames) {
+		const size_t block = 64;
+		const size_t words32 = (bits + 31) / 32;
+		uint32_t w[block][words32];
+		const int32_t* cols[field_count]; // Local copy, so the block can't alias the column pointers.
+
+		for(size_t base = 0; base < n; base += block) {
+			size_t count = n - base < block ? n - base : block;
+
+			for(size_t f = 0; f < field_count; f++)
+				cols[f] = columns[f] + base;
+
+			for(size_t i = 0; i < count; i++) {
+				uint32_t row[words32] = {};
+
+				packer::pack_column(row, cols, i);
+
+				for(size_t j = 0; j < words32; j++)
+					w[i][j] = row[j];
+			}
+
+			for(size_t i = 0; i < count; i++) {
+				uint8_t* frame = frames + (base + i) * frame_len;
+
+				frame[0] = FRAME_START;
+				for(size_t j = 0; j < payload_len / 4; j++)
+					store_be32(frame + 1 + 4 * j, w[i][j]);
+				for(size_t j = payload_len & ~(size_t)3; j < payload_len; j++)
+					frame[1 + j] = (uint8_t)(w[i][j / 4] >> (24 - 8 * (j % 4)));
+				frame[frame_len - 1] = FRAME_END;
+			}
+		}
+	}
+
+	// Unpacks n delimited frames, wherever they are, into columnar output (columns[field][frame]).
+	// The inverse of pack_columns: big-endian loads for a block first, then a branch-free field loop.
+	static void unpack_columns(const uint8_t* const* frames, size_t n, int32_t* const* columns) {
+		const size_t block = 64;
+		const size_t words32 = (bits + 31) / 32;
+		uint32_t w[block][words32];
+		int32_t* cols[field_count];
+
+		for(size_t base = 0; base < n; base += block) {
+			size_t count = n - base < block ? n - base : block;
+
+			for(size_t f = 0; f < field_count; f++)
+				cols[f] = columns[f] + base;
+
+			for(size_t i = 0; i < count; i++) {
+				const uint8_t* payload = frames[base + i] + 1;
+
+				for(size_t j = 0; j < payload_len / 4; j++)
+					w[i][j] = load_be32(payload + 4 * j);
+				if(payload_len % 4) {
+					w[i][words32 - 1] = 0;
+					for(size_t j = payload_len & ~(size_t)3; j < payload_len; j++)
+						w[i][j / 4] |= (uint32_t)payload[j] << (24 - 8 * (j % 4));
+				}
+			}
+
+			for(size_t i = 0; i < count; i++)
+				packer::unpack_column(w[i], cols, i);
+		}
+	}
+
+private:
+	static inline void store_words(const uint64_t* w, uint8_t* payload) {
+		for(size_t i = 0; i < payload_len / 8; i++)
+			store_be64(payload + 8 * i, w[i]);
+
+		for(size_t i = payload_len & ~(size_t)7; i < payload_len; i++)
+			payload[i] = (uint8_t)(w[i / 8] >> (56 - 8 * (i % 8)));
+	}
+
+	static inline void load_words(const uint8_t* payload, uint64_t* w) {
+		for(size_t i = 0; i < payload_len / 8; i++)
+			w[i] = load_be64(payload + 8 * i);
+
+		if(payload_len % 8) {
+			w[words - 1] = 0;
+
+			for(size_t i = payload_len & ~(size_t)7; i < payload_len; i++)
+				w[i / 8] |= (uint64_t)payload[i] << (56 - 8 * (i % 8));
+		}
+	}
+};
+
+typedef tlm_frame_schema<
+	tlm_field<6,  false>, // FPS
+	tlm_field<6,  false>, // error buffer
+	tlm_field<6,  true>,  // Ax
+	tlm_field<6,  true>,  // Ay
+	tlm_field<9,  true>,  // Az
+	tlm_field<10, true>,  // Gx
+	tlm_field<10, true>,  // Gy
+	tlm_field<12, true>,  // Gz
+	tlm_field<9,  true>,  // roll
+	tlm_field<9,  true>,  // pitch
+	tlm_field<9,  true>,  // yaw
+	tlm_field<12, false>, // alt.
+	tlm_field<8,  true>,  // temp.
+	tlm_field<8,  false>, // volts
+	tlm_field<8,  false>  // sequence
+> tlm_schema;
+
+static_assert(tlm_schema::field_count == TLM_FIELD_COUNT, "tlm_index and tlm_schema are out of sync");
+static_assert(tlm_schema::bits == 128, "telemetry frame payload must stay 128 bits");
+
+#define FRAME_LEN (tlm_schema::frame_len)
+
+// One complete delimited frame, by value. Lets callers keep preallocated frames instead of
+// allocating a buffer per transmission.
+typedef std::array<uint8_t, FRAME_LEN> tlm_frame;
+
+#endif //TELEMETRY_H
@@ -0,0 +1,27 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <cstdint>
+#include <ctime>
+
+#include <bcm2835.h>
+
+// Microsecond timebase shared by payload and radio: the BCM2835 1 MHz system timer, or, when
+// bcm2835 isn't initialized (payload --sim/--replay, radio --loopback off the Pi), CLOCK_MONOTONIC
+// running st_speed times faster than real time so a simulated flight plays back at that speed
+// through the whole pipeline.
+
+bool st_simulated = false;
+double st_speed = 1;
+
+static inline uint64_t st_read() {
+	if(!st_simulated)
+		return bcm2835_st_read();
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)(((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000) * st_speed);
+}
+
+#endif //TIMEBASE_H
@@ -0,0 +1,141 @@
+#ifndef TX_SCHEDULE_H
+#define TX_SCHEDULE_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include "modem.h"
+#include "telemetry.h"
+
+// Phase-adaptive telemetry scheduling (payload --phase-rates).
+//
+// Each flight phase has a tx_rate: a frame every interval_ms, or a burst of burst frames
+// burst_ms apart every interval_ms, and the set of fields worth sending. Entering a phase sends
+// a frame straight away, since the transition is news in itself.
+//
+// Fields outside the set are held at the value last sent, so the delta encoder codes them in one
+// bit each as unchanged; keyframes still carry every field and refresh them on the ground.
+//
+// On top of the cadence, telemetry may use at most budget of the radio's airtime. The budget is a
+// token bucket in microseconds of airtime, refilled at budget per microsecond and holding at most
+// TX_BUDGET_WINDOW_US worth, so a burst can spend what the pad wait saved up but not more. On a
+// slow profile one frame can cost more than that window holds (~2 s on Bw125Cr48Sf4096), so the
+// bucket always holds at least one frame's worth; otherwise nothing would ever go out. Each
+// frame is charged its time on air as a packet of its own on the modem profile the radio is
+// expected to be using. With radio --batch, frames share packets and cost less than that, so the
+// budget is an upper bound. A frame that is due but not affordable waits until it is.
+
+#define TX_BUDGET_WINDOW_US 10000000
+#define TX_FIELD(f) (1u << (f))
+#define TX_ALL_FIELDS ((1u << TLM_FIELD_COUNT) - 1)
+
+struct tx_rate {
+	int interval_ms;
+	int burst; // Frames per interval.
+	int burst_ms; // Spacing between frames in a burst.
+	uint32_t fields; // TX_FIELD() mask.
+};
+
+class tx_scheduler {
+public:
+	// plan has one tx_rate per flight phase. budget is the airtime fraction, 0 - 1.
+	tx_scheduler(const tx_rate* plan, double budget) : plan(plan), budget(budget), phase(-1), next(0), cycle(0), left(0),
+		credit(budget * TX_BUDGET_WINDOW_US), last(0), waiting(false), deferrals(0), used(0), have_sent(false) {
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+			held[f] = 0;
+	}
+
+	// True if a frame is due now in this phase and a full frame's airtime on modem m is affordable.
+	bool due(uint64_t now, int p, const modem_params& m) {
+		if(last)
+			credit += (now - last) * budget;
+		last = now;
+
+		double frame = modem_airtime_us(m, FRAME_LEN);
+		double cap = budget * TX_BUDGET_WINDOW_US;
+
+		if(cap < frame)
+			cap = frame;
+
+		if(credit > cap)
+			credit = cap;
+
+		if(p != phase) {
+			phase = p;
+			cycle = next = now;
+			left = plan[p].burst;
+		}
+
+		if(now < next)
+			return false;
+
+		if(credit < frame) {
+			deferrals += !waiting;
+			waiting = true;
+			return false;
+		}
+
+		waiting = false;
+		return true;
+	}
+
+	// Replaces the fields outside the current phase's set with the values last sent, unless the
+	// frame is going out as a keyframe.
+	void select(int64_t* tlm, bool keyframe) {
+		uint32_t fields = plan[phase].fields | TX_FIELD(TLM_SEQ);
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++) {
+			if(have_sent && !keyframe && !(fields & TX_FIELD(f)))
+				tlm[f] = held[f];
+
+			held[f] = tlm[f];
+		}
+
+		have_sent = true;
+	}
+
+	// A len byte frame or delta record went out.
+	void sent(uint64_t now, size_t len, const modem_params& m) {
+		uint64_t airtime = modem_airtime_us(m, len);
+
+		credit -= airtime;
+		used += airtime;
+
+		if(--left > 0) {
+			next = now + plan[phase].burst_ms * 1000ULL;
+			return;
+		}
+
+		left = plan[phase].burst;
+		cycle += plan[phase].interval_ms * 1000ULL;
+
+		// Waited on the budget past the whole interval: start the next one from here.
+		if(cycle < now)
+			cycle = now;
+
+		next = cycle;
+	}
+
+	uint64_t deferred() const { return deferrals; } // Times a due frame had to wait for airtime.
+	uint64_t airtime_us() const { return used; }
+
+private:
+	const tx_rate* plan;
+	double budget;
+
+	int phase;
+	uint64_t next; // Earliest time for the next frame.
+	uint64_t cycle; // Start of the current interval.
+	int left; // Frames left in the current burst.
+
+	double credit; // us of airtime.
+	uint64_t last;
+	bool waiting;
+	uint64_t deferrals;
+	uint64_t used;
+
+	int64_t held[TLM_FIELD_COUNT];
+	bool have_sent;
+};
+
+#endif //TX_SCHEDULE_H
@@ -0,0 +1,200 @@
+/*
+ * tecs-log.cpp -- TECS code: flight log inspector.
+ *
+ * Reads the columnar flight log written by payload --flightlog (../Flight/flightlog.h). Prints
+ * a summary of the log, finds apogee, or dumps one field over a time window as CSV, touching
+ * only the chunks and the column it needs.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#include <string>
+
+#include "common.h"
+#include "telemetry.h"
+#include "flightlog.h"
+
+const char* field_names[TLM_FIELD_COUNT] = {
+	"fps", "err", "ax", "ay", "az", "gx", "gy", "gz", "roll", "pitch", "yaw", "alt", "temp", "volts", "seq"
+};
+
+std::string log_path;
+std::string field_name;
+double from_s = -1; // Seconds from the first sample; negative means the start or end of the log.
+double to_s = -1;
+bool apogee = false;
+bool check = false;
+
+std::string usage = "Usage: tecs-log <file> [options]\n"
+"    -h, --help       | Show this help message.\n"
+"    --field  <name>  | Dump one field as CSV (time_us,value): fps, err, ax ... volts, seq.\n"
+"    --from     <s>   | Start of the dump, in seconds from the first sample.\n"
+"    --to       <s>   | End of the dump, in seconds from the first sample.\n"
+"    --apogee         | Print the time and altitude of the highest sample.\n"
+"    --verify         | Check every chunk's CRC.\n"
+"With no options, prints a summary of the log.\n";
+
+void parse_args(int argc, const char* argv[]) {
+	for(int i = 1; i < argc; i++) {
+		if(argv[i][0] == '-') {
+			if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+				puts(usage.c_str());
+				exit(EXIT_SUCCESS);
+			}
+
+			if(!strcmp(argv[i], "--apogee"))
+				apogee = true;
+
+			if(!strcmp(argv[i], "--verify"))
+				check = true;
+
+			if(!strcmp(argv[i], "--field")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					field_name = argv[++i];
+				else {
+					puts("--field [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--from")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					from_s = atof(argv[++i]);
+				else {
+					puts("--from [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--to")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					to_s = atof(argv[++i]);
+				else {
+					puts("--to [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+		} else
+			log_path = argv[i];
+	}
+
+	if(log_path.empty()) {
+		puts(usage.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+void summary(const flightlog_reader& log) {
+	uint64_t samples = 0, bytes = 0;
+	size_t compressed = 0;
+
+	for(size_t i = 0; i < log.chunks(); i++) {
+		samples += log.chunk(i).count;
+		bytes += log.chunk(i).size;
+		compressed += (log.chunk(i).flags & FLOG_COMPRESSED) != 0;
+	}
+
+	printf("%s: %zu chunks (%zu compressed), %llu samples, %llu bytes of chunks (%.1f bytes/sample)\n", log_path.c_str(),
+		log.chunks(), compressed, (unsigned long long)samples, (unsigned long long)bytes, samples ? (double)bytes / samples : 0.0);
+
+	if(log.chunks() == 0)
+		return;
+
+	uint64_t t0 = log.chunk(0).t_first;
+	uint64_t t1 = log.chunk(log.chunks() - 1).t_last;
+
+	printf("Time: %.3f s (%llu - %llu us)\n", (t1 - t0) / 1e6, (unsigned long long)t0, (unsigned long long)t1);
+
+	for(size_t f = 0; f < TLM_FIELD_COUNT; f++) {
+		int32_t lo = log.chunk(0).columns[f + 1].min;
+		int32_t hi = log.chunk(0).columns[f + 1].max;
+
+		for(size_t i = 1; i < log.chunks(); i++) {
+			lo = log.chunk(i).columns[f + 1].min < lo ? log.chunk(i).columns[f + 1].min : lo;
+			hi = log.chunk(i).columns[f + 1].max > hi ? log.chunk(i).columns[f + 1].max : hi;
+		}
+
+		printf("    %-6s [%d, %d]\n", field_names[f], lo, hi);
+	}
+}
+
+int main(int argc, const char* argv[]) {
+	parse_args(argc, argv);
+
+	flightlog_reader log;
+
+	if(!log.open(log_path)) {
+		fprintf(stderr, "ERR: %s is not a flight log\n", log_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	static uint64_t time_scratch[FLOG_CHUNK_SAMPLES];
+	static int32_t value_scratch[FLOG_CHUNK_SAMPLES];
+
+	if(check) {
+		size_t bad = 0;
+
+		for(size_t i = 0; i < log.chunks(); i++)
+			if(!log.verify(i)) {
+				printf("Chunk %zu (seq %u): CRC mismatch\n", i, log.chunk(i).seq);
+				bad++;
+			}
+
+		printf("%zu of %zu chunks failed CRC\n", bad, log.chunks());
+
+		if(bad)
+			return EXIT_FAILURE;
+	}
+
+	if(apogee && log.chunks() > 0) {
+		size_t c = log.find_max(TLM_ALT);
+		const uint64_t* t = log.times(c, time_scratch);
+		const int32_t* alt = log.column(c, TLM_ALT, value_scratch);
+		size_t best = 0;
+
+		for(size_t i = 1; i < log.chunk(c).count; i++)
+			if(alt[i] > alt[best])
+				best = i;
+
+		printf("Apogee: %d m at %.3f s (%llu us)\n", alt[best], (t[best] - log.chunk(0).t_first) / 1e6, (unsigned long long)t[best]);
+	}
+
+	if(!field_name.empty()) {
+		size_t field = TLM_FIELD_COUNT;
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+			if(field_name == field_names[f])
+				field = f;
+
+		if(field == TLM_FIELD_COUNT) {
+			fprintf(stderr, "ERR: unknown field %s\n", field_name.c_str());
+			return EXIT_FAILURE;
+		}
+
+		if(log.chunks() == 0)
+			return EXIT_SUCCESS;
+
+		uint64_t t0 = log.chunk(0).t_first;
+		uint64_t from = from_s < 0 ? 0 : t0 + (uint64_t)(from_s * 1e6);
+		uint64_t to = to_s < 0 ? UINT64_MAX : t0 + (uint64_t)(to_s * 1e6);
+
+		printf("time_us,%s\n", field_names[field]);
+
+		for(size_t c = log.find_time(from); c < log.chunks() && log.chunk(c).t_first <= to; c++) {
+			const uint64_t* t = log.times(c, time_scratch);
+			const int32_t* v = log.column(c, field, value_scratch);
+
+			for(size_t i = 0; i < log.chunk(c).count; i++)
+				if(t[i] >= from && t[i] <= to)
+					printf("%llu,%d\n", (unsigned long long)t[i], v[i]);
+		}
+	}
+
+	if(!apogee && !check && field_name.empty())
+		summary(log);
+
+	return EXIT_SUCCESS;
+}
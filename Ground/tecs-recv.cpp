@@ -0,0 +1,491 @@
+/*
+ * tecs-recv.cpp -- TECS code: ground station telemetry receiver.
+ *
+ * Listens for radio packets from the GNU Radio flowgraph on UDP, or replays a capture file,
+ * and decodes every telemetry frame and delta record in them with the flight-side schema
+ * (../Flight/telemetry.h, delta.h, fec.h). Event frames (events.h) are printed to stderr.
+ */
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <string>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <asio.hpp>
+
+#include "common.h"
+#include "telemetry.h"
+#include "delta.h"
+#include "events.h"
+#include "fec.h"
+#include "scan.h"
+
+#define TLM_BATCH 1024 // Samples decoded per batch handed to a sink.
+
+using asio::ip::udp;
+
+int port = GROUND_PORT;
+bool fec = false;
+std::string replay_path;
+std::string sink_name = "console";
+std::string out_path;
+
+std::string usage = "Usage:\n"
+"    -h, --help       | Show this help message.\n"
+"    --port       <#> | UDP port to listen on. Default 40868.\n"
+"    --fec            | Packets carry Reed-Solomon parity (radio --fec). Live mode only.\n"
+"    --replay  <file> | Decode a capture file (raw packets or a --sink binary output) instead of listening.\n"
+"    --sink    <name> | console, csv, binary or none. Default console.\n"
+"    --out     <file> | Write the sink output here instead of stdout.\n";
+
+// One batch of decoded samples, columnar: columns[field][sample].
+struct tlm_batch {
+	size_t n;
+	int32_t columns[TLM_FIELD_COUNT][TLM_BATCH];
+};
+
+class tlm_sink {
+public:
+	virtual ~tlm_sink() {}
+	virtual void write(const tlm_batch& batch) = 0;
+	virtual void flush() {}
+};
+
+class null_sink : public tlm_sink {
+public:
+	void write(const tlm_batch&) {}
+};
+
+// Same fields and scaling as udp-recv-demo.py, one line per sample.
+class console_sink : public tlm_sink {
+public:
+	console_sink(FILE* out) : out(out) {}
+
+	void write(const tlm_batch& b) {
+		for(size_t i = 0; i < b.n; i++)
+			fprintf(out, "seq=%3d FPS=%2d err=%2d -- Ax=%5.1f Ay=%5.1f Az=%5.1f -- Gx=%4d Gy=%4d Gz=%5d -- roll=%4d pitch=%4d yaw=%4d -- alt=%4d C=%4d V=%5.1f\n",
+				b.columns[TLM_SEQ][i], b.columns[TLM_FPS][i], b.columns[TLM_ERR][i],
+				b.columns[TLM_AX][i] / 10.0, b.columns[TLM_AY][i] / 10.0, b.columns[TLM_AZ][i] / 10.0,
+				b.columns[TLM_GX][i], b.columns[TLM_GY][i], b.columns[TLM_GZ][i],
+				b.columns[TLM_ROLL][i], b.columns[TLM_PITCH][i], b.columns[TLM_YAW][i],
+				b.columns[TLM_ALT][i], b.columns[TLM_TEMP][i], b.columns[TLM_VOLTS][i] / 10.0);
+	}
+
+	void flush() { fflush(out); }
+
+private:
+	FILE* out;
+};
+
+// Raw field values, in schema order. Formats integers by hand: printf would be the bottleneck.
+class csv_sink : public tlm_sink {
+public:
+	csv_sink(FILE* out) : out(out), used(0) {
+		fputs("fps,err,ax_x10,ay_x10,az_x10,gx,gy,gz,roll,pitch,yaw,alt,temp,volts_x10,seq\n", out);
+	}
+
+	void write(const tlm_batch& b) {
+		for(size_t i = 0; i < b.n; i++) {
+			if(used > sizeof(buffer) - TLM_FIELD_COUNT * 12)
+				flush_buffer();
+
+			char* p = buffer + used;
+
+			for(size_t f = 0; f < TLM_FIELD_COUNT; f++) {
+				p = put_int(p, b.columns[f][i]);
+				*p++ = f + 1 < TLM_FIELD_COUNT ? ',' : '\n';
+			}
+
+			used = p - buffer;
+		}
+	}
+
+	void flush() {
+		flush_buffer();
+		fflush(out);
+	}
+
+	~csv_sink() { flush(); }
+
+private:
+	static char* put_int(char* p, int32_t v) {
+		char tmp[12];
+		int n = 0;
+		uint32_t u = v < 0 ? 0 - (uint32_t)v : (uint32_t)v;
+
+		if(v < 0)
+			*p++ = '-';
+
+		do {
+			tmp[n++] = '0' + u % 10;
+			u /= 10;
+		} while(u);
+
+		while(n)
+			*p++ = tmp[--n];
+
+		return p;
+	}
+
+	void flush_buffer() {
+		fwrite(buffer, 1, used, out);
+		used = 0;
+	}
+
+	FILE* out;
+	char buffer[1 << 16];
+	size_t used;
+};
+
+// Every sample re-packed as a full frame, so deltas come out expanded and the file replays as-is.
+class binary_sink : public tlm_sink {
+public:
+	binary_sink(FILE* out) : out(out) {}
+
+	void write(const tlm_batch& b) {
+		const int32_t* cols[TLM_FIELD_COUNT];
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+			cols[f] = b.columns[f];
+
+		tlm_schema::pack_columns(cols, b.n, frames);
+		fwrite(frames, FRAME_LEN, b.n, out);
+	}
+
+	void flush() { fflush(out); }
+
+private:
+	FILE* out;
+	uint8_t frames[TLM_BATCH * FRAME_LEN];
+};
+
+// Scans a byte stream for frames and delta records and decodes them into batches.
+//
+// Frames are not copied: the scanner collects pointers to a run of frames and unpacks the whole
+// run column-wise with tlm_schema::unpack_columns. Delta records depend on the sample before them,
+// so a pending run is unpacked first and the delta decoder is primed from its last frame.
+class tlm_decoder {
+public:
+	tlm_decoder(tlm_sink& sink) : frames(0), deltas(0), delta_gaps(0), events(0), skipped(0), sink(sink), key_row(0), pending(0), prime(false) {
+		batch.n = 0;
+	}
+
+	// Everything in data is decoded (or counted as skipped) before this returns.
+	void feed(const uint8_t* data, size_t len) {
+		size_t i = 0;
+
+		while(i < len) {
+			const uint8_t* p = data + i;
+
+			if(p[0] == FRAME_START && len - i >= FRAME_LEN && p[FRAME_LEN - 1] == FRAME_END) {
+				keys[pending++] = p;
+				frames++;
+				prime = true;
+				i += FRAME_LEN;
+
+				if(key_row + pending == TLM_BATCH)
+					emit();
+				continue;
+			}
+
+			if(p[0] == DELTA_START && add_delta(p, len - i, i))
+				continue;
+
+			event_record event;
+
+			if(p[0] == EVENT_START && event_parse(p, len - i, event)) {
+				event_print(stderr, event);
+				events++;
+				i += EVENT_LEN;
+				continue;
+			}
+
+			// Not a record: jump to the next byte that could start one. Events are rare enough that
+			// a second pass for their marker costs nothing.
+			size_t next = scan_find(data, len, i + 1, FRAME_START, DELTA_START);
+			const uint8_t* event_start = (const uint8_t*)memchr(p + 1, EVENT_START, next - i - 1);
+
+			if(event_start != NULL)
+				next = event_start - data;
+
+			skipped += next - i;
+			i = next;
+		}
+
+		unpack_pending();
+	}
+
+	// Hands any partial batch to the sink.
+	void flush() {
+		emit();
+		sink.flush();
+	}
+
+	uint64_t frames;
+	uint64_t deltas;
+	uint64_t delta_gaps; // Delta records that didn't follow on: lost packets upstream, or 0x5c in noise.
+	uint64_t events;
+	uint64_t skipped; // Bytes that weren't part of any record: parity, control packets, noise.
+
+private:
+	bool add_delta(const uint8_t* p, size_t len, size_t& i) {
+		int64_t values[TLM_FIELD_COUNT];
+		bool ok;
+
+		unpack_pending();
+
+		if(prime) {
+			dec.decode(last_key, FRAME_LEN, values, ok);
+			prime = false;
+		}
+
+		size_t used = dec.decode(p, len, values, ok);
+
+		// Doesn't follow on the last sample: a packet was lost, or this 0x5c is noise and the real
+		// record starts inside it. Either way rescan from the next byte with the chain intact.
+		if(!ok) {
+			delta_gaps += used != 0;
+			return false;
+		}
+
+		i += used;
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+			batch.columns[f][key_row] = (int32_t)values[f];
+
+		deltas++;
+		key_row++;
+
+		if(key_row == TLM_BATCH)
+			emit();
+
+		return true;
+	}
+
+	void unpack_pending() {
+		if(pending == 0)
+			return;
+
+		int32_t* cols[TLM_FIELD_COUNT];
+
+		for(size_t f = 0; f < TLM_FIELD_COUNT; f++)
+			cols[f] = batch.columns[f] + key_row;
+
+		tlm_schema::unpack_columns(keys, pending, cols);
+
+		memcpy(last_key, keys[pending - 1], FRAME_LEN); // The stream buffer may not outlive feed().
+		key_row += pending;
+		pending = 0;
+	}
+
+	void emit() {
+		unpack_pending();
+
+		batch.n = key_row;
+		if(batch.n)
+			sink.write(batch);
+
+		key_row = 0;
+	}
+
+	tlm_sink& sink;
+	tlm_batch batch;
+	delta_decoder dec;
+
+	size_t key_row; // Rows of batch already filled.
+	size_t pending; // Frames found but not unpacked yet; they go in right after key_row.
+	const uint8_t* keys[TLM_BATCH];
+	uint8_t last_key[FRAME_LEN];
+	bool prime; // The delta decoder hasn't seen the newest frame yet.
+};
+
+uint8_t udp_buffer[2048];
+udp::endpoint udp_sender;
+uint64_t packets = 0;
+uint64_t fec_corrected = 0;
+uint64_t fec_failed = 0;
+
+void udp_receive(udp::socket& sock, tlm_decoder& decoder) {
+	sock.async_receive_from(asio::buffer(udp_buffer, sizeof(udp_buffer)), udp_sender, [&sock, &decoder](const asio::error_code& ec, size_t length) {
+		if(ec == asio::error::operation_aborted)
+			return;
+
+		if(!ec) {
+			size_t data_len = length;
+			packets++;
+
+			if(fec) {
+				int r = fec_decode(udp_buffer, length, data_len);
+
+				if(r > 0)
+					fec_corrected += r;
+				else if(r < 0)
+					fec_failed++; // Scan it anyway; the frame delimiters still reject most damage.
+			}
+
+			decoder.feed(udp_buffer, data_len);
+			decoder.flush();
+		}
+
+		udp_receive(sock, decoder);
+	});
+}
+
+void parse_args(int argc, const char* argv[]) {
+	for(int i = 0; i < argc; i++) {
+		if(argv[i][0] == '-') {
+			if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+				puts(usage.c_str());
+				exit(EXIT_SUCCESS);
+			}
+
+			if(!strcmp(argv[i], "--fec"))
+				fec = true;
+
+			if(!strcmp(argv[i], "--port")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					port = atoi(argv[i + 1]);
+				else {
+					puts("--port [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--replay")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					replay_path = argv[i + 1];
+				else {
+					puts("--replay [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--sink")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					sink_name = argv[i + 1];
+				else {
+					puts("--sink [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if(!strcmp(argv[i], "--out")) {
+				if(argc > i + 1 && argv[i + 1][0] != '-')
+					out_path = argv[i + 1];
+				else {
+					puts("--out [i + 1] fail");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+}
+
+int replay(tlm_decoder& decoder) {
+	int fd = open(replay_path.c_str(), O_RDONLY);
+	struct stat st;
+
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "ERR: can't open %s\n", replay_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	if(st.st_size == 0) {
+		close(fd);
+		return EXIT_SUCCESS;
+	}
+
+	const uint8_t* data = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(data == MAP_FAILED) {
+		fprintf(stderr, "ERR: can't map %s\n", replay_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	decoder.feed(data, st.st_size);
+	decoder.flush();
+
+	double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	uint64_t samples = decoder.frames + decoder.deltas;
+
+	fprintf(stderr, "Replayed %lld bytes in %.3f s: %.2f Msamples/s, %.1f MB/s\n", (long long)st.st_size, s,
+		samples / s / 1e6, st.st_size / s / 1e6);
+
+	munmap((void*)data, st.st_size);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, const char* argv[]) {
+	parse_args(argc, argv);
+
+	FILE* out = stdout;
+	if(!out_path.empty() && (out = fopen(out_path.c_str(), "wb")) == NULL) {
+		fprintf(stderr, "ERR: can't open %s\n", out_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	tlm_sink* sink;
+
+	if(sink_name == "console")
+		sink = new console_sink(out);
+	else if(sink_name == "csv")
+		sink = new csv_sink(out);
+	else if(sink_name == "binary")
+		sink = new binary_sink(out);
+	else if(sink_name == "none")
+		sink = new null_sink();
+	else {
+		puts("--sink: console, csv, binary or none");
+		return EXIT_FAILURE;
+	}
+
+	tlm_decoder* decoder = new tlm_decoder(*sink);
+	int ret = EXIT_SUCCESS;
+
+	if(!replay_path.empty())
+		ret = replay(*decoder);
+	else {
+		asio::io_service io_service;
+		udp::socket sock(io_service, udp::endpoint(udp::v4(), port));
+		asio::signal_set signals(io_service, SIGINT, SIGTERM);
+
+		signals.async_wait([&io_service](const asio::error_code&, int) { io_service.stop(); });
+
+		fprintf(stderr, "Listening on UDP %d...\n", port);
+
+		udp_receive(sock, *decoder);
+		io_service.run();
+
+		fprintf(stderr, "%llu packets", (unsigned long long)packets);
+		if(fec)
+			fprintf(stderr, ", FEC %llu bytes corrected, %llu packets uncorrectable", (unsigned long long)fec_corrected, (unsigned long long)fec_failed);
+		fputs("\n", stderr);
+	}
+
+	fprintf(stderr, "%llu frames, %llu deltas, %llu deltas out of sequence, %llu events, %llu bytes skipped\n", (unsigned long long)decoder->frames,
+		(unsigned long long)decoder->deltas, (unsigned long long)decoder->delta_gaps, (unsigned long long)decoder->events,
+		(unsigned long long)decoder->skipped);
+
+	delete decoder;
+	delete sink;
+
+	if(out != stdout)
+		fclose(out);
+
+	return ret;
+}
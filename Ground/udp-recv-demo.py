@@ -8,40 +8,57 @@ from bitstring import BitArray, BitStream
 UDP_IP = "127.0.0.1"
 UDP_PORT = 40868
 
+FRAME_START = 0x5e
+FRAME_END = 0xd5
+FRAME_LEN = 18
+
 sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
 sock.bind((UDP_IP, UDP_PORT))
 
+# A radio packet may carry several frames back to back when the flight radio aggregates (--batch).
+# Walk the packet and decode every 0x5e ... 0xd5 frame in it.
+def frames(data):
+	i = 0
+	while i + FRAME_LEN <= len(data):
+		if data[i] == FRAME_START and data[i + FRAME_LEN - 1] == FRAME_END:
+			yield data[i + 1:i + FRAME_LEN - 1]
+			i += FRAME_LEN
+		else:
+			i += 1
+
+def decode(payload):
+	tlm = BitStream(payload)
+	print(tlm.bin)
+	fps, err, Ax, Ay, Az, Gx, Gy, Gz, roll, pitch, yaw, alt, temp, volts, resv = tlm.readlist('bits:6, bits:6, int:6, int:6, int:9, int:10, int:10, int:12, int:9, int:9, int:9, uint:12, int:8, uint:8, bits:8')
+
+	Ax /= 10
+	Ay /= 10
+	Az /= 10
+	volts /= 10
+
+	print("FPS = {}".format(fps))
+	print("err = {}".format(err))
+	print(" Ax = {}".format(Ax))
+	print(" Ay = {}".format(Ay))
+	print(" Az = {}".format(Az))
+	print(" Gx = {}".format(Gx))
+	print(" Gy = {}".format(Gy))
+	print(" Gz = {}".format(Gz))
+	print("rol = {}".format(roll))
+	print("pit = {}".format(pitch))
+	print("yaw = {}".format(yaw))
+	print("alt = {}".format(alt))
+	print(" C  = {}".format(temp))
+	print(" V  = {}".format(volts))
+
 while True:
 	try:
 		data, addr = sock.recvfrom(1024)
-		data = data.split(b'\x5e')[1]
-		data = data.split(b'\xd5')[0]
-
-		tlm = BitStream(data)
-		print(tlm.bin)
-		fps, err, Ax, Ay, Az, Gx, Gy, Gz, roll, pitch, yaw, alt, temp, volts, resv = tlm.readlist('bits:6, bits:6, int:6, int:6, int:9, int:10, int:10, int:12, int:9, int:9, int:9, uint:12, int:8, uint:8, bits:8')
-
-		Ax /= 10
-		Ay /= 10
-		Az /= 10
-		volts /= 10
-
-		print("FPS = {}".format(fps))
-		print("err = {}".format(err))
-		print(" Ax = {}".format(Ax))
-		print(" Ay = {}".format(Ay))
-		print(" Az = {}".format(Az))
-		print(" Gx = {}".format(Gx))
-		print(" Gy = {}".format(Gy))
-		print(" Gz = {}".format(Gz))
-		print("rol = {}".format(roll))
-		print("pit = {}".format(pitch))
-		print("yaw = {}".format(yaw))
-		print("alt = {}".format(alt))
-		print(" C  = {}".format(temp))
-		print(" V  = {}".format(volts))
+
+		for payload in frames(data):
+			decode(payload)
 	except bitstring.ReadError:
 		print("BS ReadError")
 		continue
 	except KeyboardInterrupt:
-		sys.exit()
\ No newline at end of file
+		sys.exit()